@@ -1,195 +1,947 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
 #include <ostream>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include <sys/resource.h>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+enum class expr_kind : std::uint8_t {
+  constant,
+  variable,
+  add,
+  sub,
+  mul,
+  div,
+  pow,
+  ln,
+  thunk,
+};
+
+// Nodes are owned by the session arena that built them and are never freed
+// individually, so a plain pointer is the handle. The node set is closed:
+// derive() and display() switch on the kind tag instead of going through a
+// vtable, and expr_cast replaces dynamic_cast.
 class base_expr {
 public:
-  using base_expr_s = std::shared_ptr<base_expr>;
-  virtual base_expr_s diff(base_expr_s dv) = 0;
-  virtual std::ostream &display(std::ostream &os) const = 0;
-  virtual bool is_constant() { return false; }
-  virtual ~base_expr() = default;
+  using base_expr_s = base_expr *;
+
+  expr_kind kind() const { return kind_tag; }
+  bool is_constant() const { return kind_tag == expr_kind::constant; }
+  // Built only from constants, variables, +, -, * and natural powers, or
+  // divided by a constant, with no product of two sums and no power of
+  // one, so that expanding it never multiplies out factors; see
+  // polynomial.
+  bool is_polynomial() const { return poly_terms > 0; }
+  // For a polynomial, a bound on the terms of its expansion, saturating
+  // at UINT32_MAX; 0 for anything else.
+  std::uint32_t terms() const { return poly_terms; }
+  // Depends only on the structure of the expression, never on addresses, so
+  // it is stable across sessions and processes.
+  std::uint64_t hash() const { return shape; }
+  // Bit id % 64 set for every variable the expression contains. Disjoint
+  // masks prove independence; overlapping ones only suggest dependence.
+  std::uint64_t var_mask() const { return vars; }
+
+  // Children in evaluation order; leaves have none.
+  std::size_t arity() const;
+  base_expr_s operand(std::size_t i) const;
+
+  // Memoized in the current session, see derivative_cache. Both walk the
+  // tree with an explicit stack, so depth is not bounded by the native one.
+  base_expr_s diff(base_expr_s dv);
+  // The derivative built one level deep, with the derivatives of operands
+  // left as thunks that expand when a traversal first reaches them. This
+  // pays off when only part of the result is read; settle() turns it into
+  // what diff() builds, at more cost than diff() itself.
+  base_expr_s lazy_diff(base_expr_s dv);
+  // Infix, as serialize() writes it.
+  std::ostream &display(std::ostream &os) const;
+
+protected:
+  base_expr(expr_kind kind_tag, std::uint64_t shape, std::uint64_t vars,
+            std::uint32_t poly_terms = 0)
+      : kind_tag(kind_tag), poly_terms(poly_terms), shape(shape),
+        vars(vars) {};
+
+private:
+  expr_kind kind_tag;
+  std::uint32_t poly_terms;
+  std::uint64_t shape;
+  std::uint64_t vars;
+
+  base_expr_s derive(base_expr_s dv);
+  // Set while a thunk expands, so that diff() defers operands.
+  static bool &deferring() {
+    static thread_local bool on = false;
+    return on;
+  }
+
+  friend class thunk;
 };
 
 using base_expr_s = base_expr::base_expr_s;
 
+// Downcast checked against the kind tag; nullptr when e is another kind.
+template <typename T> T *expr_cast(base_expr *e) {
+  return e->kind() == T::tag ? static_cast<T *>(e) : nullptr;
+}
+
 std::ostream &operator<<(std::ostream &os, base_expr const &be) {
   return be.display(os);
 };
 
-class constant : public base_expr {
+inline std::uint64_t hash_mix(std::uint64_t h, std::uint64_t v) {
+  h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 33);
+}
+
+// FNV-1a, for hashes that have to be reproducible.
+inline std::uint64_t hash_bytes(void const *data, std::size_t len) {
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+  for (std::size_t i = 0; i < len; ++i) {
+    h ^= static_cast<unsigned char const *>(data)[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Canonical order of n-ary operands: constants first, then by structural
+// hash. Sums and products sort on the term without its coefficient, or the
+// base without its exponent, so that like terms end up adjacent. Operands
+// are interned, so a sum or product interns to the same node whatever
+// order it was built in.
+inline bool canonical_less(base_expr const *a, base_expr const *b) {
+  if (a->is_constant() != b->is_constant())
+    return a->is_constant();
+  if (a->hash() != b->hash())
+    return a->hash() < b->hash();
+  return a < b;
+}
+
+// Event counter written by one thread only, so bumping it is a plain load
+// and store; it is atomic only so that other threads may read it.
+class counter {
 private:
-  std::double_t val;
+  std::atomic<std::uint64_t> n{0};
 
 public:
-  static constexpr double E = 2.718281828459045;
+  counter() = default;
+  counter(counter const &other) : n(other.get()) {}
+  counter &operator=(counter const &other) {
+    set(other.get());
+    return *this;
+  }
+
+  void add(std::uint64_t k = 1) { set(get() + k); }
+  void set(std::uint64_t v) { n.store(v, std::memory_order_relaxed); }
+  std::uint64_t get() const { return n.load(std::memory_order_relaxed); }
+};
+
+// Simplifications the factories apply instead of building a node.
+enum class rewrite : std::uint8_t {
+  constant_fold, // c - c, c / c, c ^ c
+  add_zero,      // x + 0 -> x
+  sub_zero,      // x - 0 -> x
+  sub_self,      // x - x -> 0
+  div_one,       // x / 1 -> x
+  div_zero,      // 0 / x -> 0
+  pow_zero,      // x ^ 0 -> 1
+  pow_one,       // x ^ 1 -> x
+  ln_e,          // ln(e) -> 1
+  mul_one,       // x * 1 -> x
+  mul_zero,      // 0 * ... -> 0
+  like_terms,    // 2x + 3x -> 5x, x * x^2 -> x^3
+  collapse,      // a sum or product left with at most one operand
+};
+
+constexpr std::size_t kind_count = 9;
+constexpr std::size_t rewrite_count = 13;
+
+// Instrumentation, always on. Every thread counts into its own
+// engine_stats; total() adds up those of all threads, live or finished.
+struct engine_stats {
+  counter created[kind_count]; // nodes built, per kind
+  counter reused[kind_count];  // creations answered by the intern table
+  counter rewrites[rewrite_count];
+  counter derived;         // diff() results computed
+  counter derived_poly;    // ... of which through polynomial expansion
+  counter derivative_hits; // diff() results taken from the cache
+  counter mask_skips;      // diff() calls answered 0 by the variable mask
+  counter forced;          // thunks expanded
+  counter disk_hits;       // derivatives loaded from a disk_cache
+  counter disk_stores;     // ... and written to one
+  // Filled in by callers that measure whole expressions, like the CLI.
+  counter input_nodes;
+  counter output_nodes;
+  counter parse_ns;
+  counter diff_ns;
+  counter print_ns;
+  // The input with the largest output/input node ratio.
+  counter worst_input;
+  counter worst_output;
+  counter worst_line;
+
+  void count(rewrite r) { rewrites[static_cast<std::size_t>(r)].add(); }
 
-  constant(std::double_t val) : val(val) {};
-  base_expr_s diff(base_expr_s dv) override {
-    return base_expr_s(new constant(0));
+  void merge(engine_stats const &other) {
+    auto sum = [](counter *a, counter const *b, std::size_t n) {
+      for (std::size_t i = 0; i < n; ++i)
+        a[i].add(b[i].get());
+    };
+    sum(created, other.created, kind_count);
+    sum(reused, other.reused, kind_count);
+    sum(rewrites, other.rewrites, rewrite_count);
+    sum(&derived, &other.derived, 1);
+    sum(&derived_poly, &other.derived_poly, 1);
+    sum(&derivative_hits, &other.derivative_hits, 1);
+    sum(&mask_skips, &other.mask_skips, 1);
+    sum(&forced, &other.forced, 1);
+    sum(&disk_hits, &other.disk_hits, 1);
+    sum(&disk_stores, &other.disk_stores, 1);
+    sum(&input_nodes, &other.input_nodes, 1);
+    sum(&output_nodes, &other.output_nodes, 1);
+    sum(&parse_ns, &other.parse_ns, 1);
+    sum(&diff_ns, &other.diff_ns, 1);
+    sum(&print_ns, &other.print_ns, 1);
+    note_swell(other.worst_input.get(), other.worst_output.get(),
+               other.worst_line.get());
   }
-  bool is_constant() override { return true; }
-  std::double_t value() { return val; }
 
-  std::ostream &display(std::ostream &os) const override { return os << val; }
+  void note_swell(std::uint64_t in, std::uint64_t out, std::uint64_t line) {
+    if (in == 0)
+      return;
+    // out / in > worst_output / worst_input, without dividing.
+    if (worst_input.get() == 0 ||
+        out * worst_input.get() > worst_output.get() * in) {
+      worst_input.set(in);
+      worst_output.set(out);
+      worst_line.set(line);
+    }
+  }
 
-  bool is_const_e() { return fabs(val - E) < 0.0000000001; }
+  // The calling thread's counters.
+  static engine_stats &local();
+  // Everything counted so far, by every thread.
+  static engine_stats total();
+
+  void report(std::ostream &os) const;
 };
 
-class variable : public base_expr {
+// Every thread's engine_stats, plus the sum of those whose thread is gone.
+struct stats_registry {
+  std::mutex lock;
+  std::vector<engine_stats const *> live;
+  engine_stats retired;
+
+  static stats_registry &get() {
+    static stats_registry *r = new stats_registry; // outlives thread_locals
+    return *r;
+  }
+};
+
+struct stats_registration {
+  engine_stats stats;
+
+  stats_registration() {
+    stats_registry &r = stats_registry::get();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.live.push_back(&stats);
+  }
+  ~stats_registration() {
+    stats_registry &r = stats_registry::get();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.live.erase(std::find(r.live.begin(), r.live.end(), &stats));
+    r.retired.merge(stats);
+  }
+};
+
+engine_stats &engine_stats::local() {
+  static thread_local stats_registration self;
+  return self.stats;
+}
+
+engine_stats engine_stats::total() {
+  stats_registry &r = stats_registry::get();
+  std::lock_guard<std::mutex> guard(r.lock);
+  engine_stats sum;
+  sum.merge(r.retired);
+  for (engine_stats const *s : r.live)
+    sum.merge(*s);
+  return sum;
+}
+
+// Bump allocator for expression nodes. Nodes are carved out of large blocks
+// and the whole arena is released at once; destructors are never run, so
+// nodes must be trivially destructible.
+class expr_arena {
 private:
-  std::string name;
+  static constexpr std::size_t block_size = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *cursor = nullptr;
+  std::size_t remaining = 0;
+  std::size_t allocated = 0;
+  // Atomic so that bytes() may be read while another thread allocates;
+  // allocation itself is serialized by the owner.
+  std::atomic<std::size_t> reserved{0};
+
+  void *allocate(std::size_t size, std::size_t align) {
+    std::size_t pad = -reinterpret_cast<std::uintptr_t>(cursor) & (align - 1);
+    if (cursor == nullptr || pad + size > remaining) {
+      std::size_t len = std::max(block_size, size + align);
+      blocks.emplace_back(new char[len]);
+      cursor = blocks.back().get();
+      remaining = len;
+      reserved.store(reserved.load(std::memory_order_relaxed) + len,
+                     std::memory_order_relaxed);
+      pad = -reinterpret_cast<std::uintptr_t>(cursor) & (align - 1);
+    }
+    void *p = cursor + pad;
+    cursor += pad + size;
+    remaining -= pad + size;
+    return p;
+  }
 
 public:
-  variable(std::string name) : name(name) {};
-  variable(std::uint16_t coff, std::string name) : name(name) {};
-  virtual base_expr_s diff(base_expr_s dv) override {
-    variable const *other = static_cast<variable const *>(dv.get());
-    if (name == other->name)
-      return base_expr_s(new constant(1));
+  expr_arena() = default;
+  expr_arena(expr_arena const &) = delete;
+  expr_arena &operator=(expr_arena const &) = delete;
+
+  template <typename T, typename... Args> T *make(Args &&...args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena nodes are never destroyed");
+    ++allocated;
+    return new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+  }
+
+  // Operand storage for n-ary nodes, living as long as the nodes do.
+  template <typename T> T *copy(std::vector<T> const &items) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "arena arrays are copied bytewise");
+    void *p = allocate(sizeof(T) * items.size(), alignof(T));
+    std::memcpy(p, items.data(), sizeof(T) * items.size());
+    return static_cast<T *>(p);
+  }
+
+  std::size_t nodes() const { return allocated; }
+  std::size_t bytes() const {
+    return reserved.load(std::memory_order_relaxed);
   }
-  std::ostream &display(std::ostream &os) const override { return os << name; }
-  ~variable() = default;
 };
 
-class add : public base_expr {
+// Structural identity of a node. Children are compared by address, which is
+// sound because they are interned themselves; variables are keyed by their
+// symbol id. N-ary nodes use args/count instead of lhs/rhs.
+struct expr_key {
+  expr_kind kind;
+  base_expr const *lhs = nullptr;
+  base_expr const *rhs = nullptr;
+  std::double_t val = 0;
+  std::uint32_t symbol = 0;
+  base_expr *const *args = nullptr;
+  std::uint32_t count = 0;
+
+  bool operator==(expr_key const &other) const {
+    return kind == other.kind && lhs == other.lhs && rhs == other.rhs &&
+           val == other.val && symbol == other.symbol && count == other.count &&
+           std::equal(args, args + count, other.args);
+  }
+};
+
+struct expr_key_hash {
+  std::size_t operator()(expr_key const &key) const {
+    std::size_t h = static_cast<std::size_t>(key.kind);
+    auto mix = [&h](std::size_t v) {
+      h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    };
+    mix(std::hash<base_expr const *>()(key.lhs));
+    mix(std::hash<base_expr const *>()(key.rhs));
+    mix(std::hash<std::double_t>()(key.val));
+    mix(key.symbol);
+    for (std::uint32_t i = 0; i < key.count; ++i)
+      mix(std::hash<base_expr const *>()(key.args[i]));
+    return h;
+  }
+};
+
+// Holds m for the current scope when a session is shared between threads;
+// an unshared session passes nullptr and pays nothing.
+inline std::unique_lock<std::mutex> maybe_lock(std::mutex *m) {
+  return m ? std::unique_lock<std::mutex>(*m) : std::unique_lock<std::mutex>();
+}
+
+// Hash-consing table behind every create() factory. Building a node that
+// already exists returns the live one, so the expression becomes a DAG and
+// structural equality is pointer equality.
+class intern_table {
 private:
-  base_expr_s lhs;
-  base_expr_s rhs;
+  std::unordered_map<expr_key, base_expr_s, expr_key_hash> nodes;
+  expr_arena &arena;
 
 public:
-  add(base_expr_s lhs, base_expr_s rhs) : lhs(lhs), rhs(rhs) {};
+  std::mutex *lock = nullptr;
 
-  static base_expr_s create(base_expr_s lhs, base_expr_s rhs) {
-    if (lhs->is_constant()) {
-      constant *lhs_p = dynamic_cast<constant *>(lhs.get());
-      if (lhs_p->value() == 0) {
-        return rhs;
-      }
+  intern_table(expr_arena &arena) : arena(arena) {};
+
+  template <typename T, typename... Args>
+  base_expr_s get(expr_key const &key, Args &&...args) {
+    auto guard = maybe_lock(lock);
+    engine_stats &stats = engine_stats::local();
+    auto it = nodes.find(key);
+    if (it != nodes.end()) {
+      stats.reused[static_cast<std::size_t>(T::tag)].add();
+      return it->second;
     }
-    if (rhs->is_constant()) {
-      constant *rhs_p = dynamic_cast<constant *>(rhs.get());
-      if (rhs_p->value() == 0) {
-        return lhs;
-      }
+    stats.created[static_cast<std::size_t>(T::tag)].add();
+    base_expr_s node = arena.make<T>(std::forward<Args>(args)...);
+    nodes.emplace(key, node);
+    return node;
+  }
+
+  // For n-ary kinds built as T(operands, count). The stored key points at
+  // the node's own operand array, so lookups can use a temporary one.
+  template <typename T>
+  base_expr_s get_nary(std::vector<base_expr_s> const &ops) {
+    expr_key key{T::tag};
+    key.args = ops.data();
+    key.count = static_cast<std::uint32_t>(ops.size());
+    auto guard = maybe_lock(lock);
+    engine_stats &stats = engine_stats::local();
+    auto it = nodes.find(key);
+    if (it != nodes.end()) {
+      stats.reused[static_cast<std::size_t>(T::tag)].add();
+      return it->second;
     }
-    return base_expr_s(new add(lhs, rhs));
+    stats.created[static_cast<std::size_t>(T::tag)].add();
+    key.args = arena.copy(ops);
+    base_expr_s node = arena.make<T>(key.args, key.count);
+    nodes.emplace(key, node);
+    return node;
+  }
+
+  base_expr_s find(expr_key const &key) {
+    auto guard = maybe_lock(lock);
+    auto it = nodes.find(key);
+    return it == nodes.end() ? nullptr : it->second;
   }
 
-  base_expr_s diff(base_expr_s dv) override {
-    base_expr_s lhs_d(lhs->diff(dv));
-    base_expr_s rhs_d(rhs->diff(dv));
+  std::size_t size() const { return nodes.size(); }
+  void reserve(std::size_t n) { nodes.reserve(nodes.size() + n); }
+};
+
+// Derivatives already computed in a session, keyed by (node, variable). With
+// nodes shared through the intern table, a subexpression reached through
+// several parents is differentiated once per variable.
+class derivative_cache {
+private:
+  using key = std::pair<base_expr const *, base_expr const *>;
 
-    if (lhs_d->is_constant() && rhs_d->is_constant()) {
-      constant *lhs_p = dynamic_cast<constant *>(lhs_d.get());
-      constant *rhs_p = dynamic_cast<constant *>(rhs_d.get());
-      return base_expr_s(new constant(lhs_p->value() + rhs_p->value()));
+  struct key_hash {
+    std::size_t operator()(key const &k) const {
+      std::size_t h = std::hash<base_expr const *>()(k.first);
+      std::size_t v = std::hash<base_expr const *>()(k.second);
+      return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
     }
+  };
+
+  std::unordered_map<key, base_expr_s, key_hash> entries;
+
+public:
+  std::mutex *lock = nullptr;
+
+  base_expr_s find(base_expr const *expr, base_expr const *dv) const {
+    auto guard = maybe_lock(lock);
+    auto it = entries.find({expr, dv});
+    return it == entries.end() ? nullptr : it->second;
+  }
 
-    return base_expr_s(new add(lhs_d, rhs_d));
+  void insert(base_expr const *expr, base_expr const *dv, base_expr_s d) {
+    auto guard = maybe_lock(lock);
+    entries.emplace(key{expr, dv}, d);
   }
 
-  std::ostream &display(std::ostream &os) const override {
-    os << '(';
-    lhs->display(os);
-    os << " + ";
-    rhs->display(os);
-    os << ')';
-    return os;
+  // Every (expression, variable, derivative) entry, copied under the lock.
+  std::vector<std::tuple<base_expr_s, base_expr_s, base_expr_s>>
+  snapshot() const {
+    auto guard = maybe_lock(lock);
+    std::vector<std::tuple<base_expr_s, base_expr_s, base_expr_s>> out;
+    out.reserve(entries.size());
+    for (auto const &[k, d] : entries)
+      out.emplace_back(const_cast<base_expr_s>(k.first),
+                       const_cast<base_expr_s>(k.second), d);
+    return out;
   }
-  ~add() = default;
+
+  std::size_t size() const { return entries.size(); }
 };
 
-class sub : public base_expr {
+// Variable names, numbered in order of first use. Variable nodes carry only
+// the number, so telling two variables apart is an integer compare.
+class symbol_table {
 private:
-  base_expr_s lhs;
-  base_expr_s rhs;
+  std::unordered_map<std::string, std::uint32_t> ids;
+  std::vector<std::string const *> names;
 
 public:
-  sub(base_expr_s lhs, base_expr_s rhs) : lhs(lhs), rhs(rhs) {};
+  std::uint32_t intern(std::string const &name) {
+    auto [it, fresh] =
+        ids.emplace(name, static_cast<std::uint32_t>(names.size()));
+    if (fresh)
+      names.push_back(&it->first);
+    return it->second;
+  }
 
-  static base_expr_s create(base_expr_s lhs, base_expr_s rhs) {
-    if (rhs->is_constant()) {
-      constant *rhs_p = dynamic_cast<constant *>(rhs.get());
-      if (rhs_p->value() == 0) {
-        return lhs;
-      }
-    }
-    return base_expr_s(new sub(lhs, rhs));
+  std::string const &name(std::uint32_t id) const { return *names[id]; }
+  std::size_t size() const { return names.size(); }
+};
+
+// A differentiation session owns every node built while it is active. All
+// of them are released together when the session goes away, so expressions
+// must not outlive the session they were created in.
+class session {
+private:
+  expr_arena arena;
+  symbol_table symbols;
+  std::mutex node_lock;
+  std::mutex cache_lock;
+  std::mutex symbol_lock;
+  bool shared = false;
+
+  static session *&active() {
+    static thread_local session *current = nullptr;
+    return current;
   }
 
-  virtual base_expr_s diff(base_expr_s be) override {
-    base_expr_s lhs_d(lhs->diff(be));
-    base_expr_s rhs_d(rhs->diff(be));
+  static std::unique_ptr<session> &fallback() {
+    static thread_local std::unique_ptr<session> s;
+    return s;
+  }
+
+  friend class session_scope;
+
+public:
+  intern_table interned{arena};
+  derivative_cache derivatives;
+  // constant(0) and constant(1), which nearly every simplification returns,
+  // cached so building them skips the intern table.
+  base_expr_s zero = nullptr;
+  base_expr_s one = nullptr;
+
+  session() = default;
+  session(session const &) = delete;
+  session &operator=(session const &) = delete;
+
+  // The session installed by the innermost session_scope on this thread, or
+  // a per-thread default one when there is none.
+  static session &current() {
+    if (session *s = active())
+      return *s;
+    std::unique_ptr<session> &s = fallback();
+    if (!s)
+      s.reset(new session);
+    return *s;
+  }
+
+  // Replaces this thread's default session with a fresh one once its arena
+  // has grown past max_bytes. Every expression built in the old one dies
+  // with it, so call this only between independent pieces of work.
+  static void recycle(std::size_t max_bytes) {
+    std::unique_ptr<session> &s = fallback();
+    if (s && s->arena.bytes() > max_bytes)
+      s.reset();
+  }
+
+  std::uint32_t intern_symbol(std::string const &name) {
+    auto guard = maybe_lock(shared ? &symbol_lock : nullptr);
+    return symbols.intern(name);
+  }
+
+  std::string const &symbol_name(std::uint32_t id) {
+    auto guard = maybe_lock(shared ? &symbol_lock : nullptr);
+    return symbols.name(id);
+  }
+
+  // Lets several threads build nodes in this session at once, each having
+  // entered it with its own session_scope. Every intern and cache access
+  // then takes a lock, so leave sharing off when only one thread is busy.
+  void share(bool on);
+  bool is_shared() const { return shared; }
+
+  // Copies the nodes reachable from roots into next, a fresh session,
+  // along with the derivatives cached for them, and returns the roots as
+  // nodes of next. Live nodes end up contiguous in next's arena and
+  // everything else stays behind. This session is only read, so other
+  // threads can keep working in it meanwhile; see session_generations.
+  std::vector<base_expr_s> collect(session &next,
+                                   std::vector<base_expr_s> const &roots);
+
+  expr_arena const &nodes() const { return arena; }
+};
+
+class session_scope {
+private:
+  session *previous;
+
+public:
+  session_scope(session &s) : previous(session::active()) {
+    session::active() = &s;
+  }
+  session_scope(session_scope const &) = delete;
+  session_scope &operator=(session_scope const &) = delete;
+  ~session_scope() { session::active() = previous; }
+};
 
-    if (lhs_d->is_constant() && rhs_d->is_constant()) {
-      constant *lhs_p = dynamic_cast<constant *>(lhs_d.get());
-      constant *rhs_p = dynamic_cast<constant *>(rhs_d.get());
-      return base_expr_s(new constant(lhs_p->value() - rhs_p->value()));
+class constant : public base_expr {
+private:
+  std::double_t val;
+
+  // +0 and -0 compare equal, so they must hash alike.
+  static std::uint64_t bits(std::double_t v) {
+    if (v == 0)
+      return 0;
+    std::uint64_t u;
+    std::memcpy(&u, &v, sizeof u);
+    return u;
+  }
+
+public:
+  static constexpr expr_kind tag = expr_kind::constant;
+  static constexpr double E = 2.718281828459045;
+
+  constant(std::double_t val)
+      : base_expr(tag, hash_mix(static_cast<std::uint64_t>(tag), bits(val)), 0,
+                  1),
+        val(val) {};
+  static base_expr_s create(std::double_t val) {
+    session &s = session::current();
+    base_expr_s *common = val == 0 ? &s.zero : val == 1 ? &s.one : nullptr;
+    if (common && *common) {
+      engine_stats::local().reused[static_cast<std::size_t>(tag)].add();
+      return *common;
     }
+    expr_key key{tag};
+    key.val = val;
+    base_expr_s node = s.interned.get<constant>(key, val);
+    if (common)
+      *common = node;
+    return node;
+  }
+  base_expr_s derive(base_expr_s) { return constant::create(0); }
+  std::double_t value() const { return val; }
+  bool is_const_e() const { return fabs(val - E) < 0.0000000001; }
+};
+
+void session::share(bool on) {
+  // The 0/1 shortcut in constant::create writes unlocked; fill it first.
+  session_scope scope(*this);
+  constant::create(0);
+  constant::create(1);
+  shared = on;
+  interned.lock = on ? &node_lock : nullptr;
+  derivatives.lock = on ? &cache_lock : nullptr;
+}
+
+inline std::uint64_t binary_hash(expr_kind kind, base_expr_s lhs,
+                                 base_expr_s rhs) {
+  return hash_mix(hash_mix(static_cast<std::uint64_t>(kind), lhs->hash()),
+                  rhs->hash());
+}
+
+inline std::uint64_t nary_hash(expr_kind kind, base_expr *const *args,
+                               std::uint32_t count) {
+  std::uint64_t h = static_cast<std::uint64_t>(kind);
+  for (std::uint32_t i = 0; i < count; ++i)
+    h = hash_mix(h, args[i]->hash());
+  return h;
+}
+
+inline std::uint64_t nary_mask(base_expr *const *args, std::uint32_t count) {
+  std::uint64_t mask = 0;
+  for (std::uint32_t i = 0; i < count; ++i)
+    mask |= args[i]->var_mask();
+  return mask;
+}
+
+// base_expr::terms() of a sum or difference of args: the terms add up.
+inline std::uint32_t sum_terms(base_expr *const *args, std::uint32_t count) {
+  std::uint64_t n = 0;
+  for (std::uint32_t i = 0; i < count; ++i) {
+    if (!args[i]->is_polynomial())
+      return 0;
+    n = std::min<std::uint64_t>(n + args[i]->terms(), UINT32_MAX);
+  }
+  return static_cast<std::uint32_t>(n);
+}
+
+inline std::uint32_t sum_terms(base_expr_s lhs, base_expr_s rhs) {
+  base_expr *args[] = {lhs, rhs};
+  return sum_terms(args, 2);
+}
+
+// ... and of a product, which must have at most one factor with several
+// terms: distributing a sum over monomials keeps its size, multiplying
+// sums out does not.
+inline std::uint32_t product_terms(base_expr *const *args,
+                                   std::uint32_t count) {
+  std::uint32_t n = 1;
+  for (std::uint32_t i = 0; i < count; ++i) {
+    std::uint32_t t = args[i]->terms();
+    if (t == 0 || (t > 1 && n > 1))
+      return 0;
+    n = std::max(n, t);
+  }
+  return n;
+}
+
+inline bool is_natural(base_expr_s e) {
+  constant *c = expr_cast<constant>(e);
+  return c && c->value() >= 0 && c->value() == std::floor(c->value()) &&
+         c->value() < 4294967296.0;
+}
+
+class variable : public base_expr {
+private:
+  std::uint32_t id;
+  // In the symbol table of the session that owns the node, which outlives
+  // it.
+  std::string const *name;
 
-    return base_expr_s(new add(lhs_d, rhs_d));
+public:
+  static constexpr expr_kind tag = expr_kind::variable;
+
+  // Hashed by name rather than id, which depends on the order variables
+  // were first seen in. name must be the symbol table's copy.
+  variable(std::uint32_t id, std::string const &name)
+      : base_expr(tag,
+                  hash_mix(static_cast<std::uint64_t>(tag),
+                           hash_bytes(name.data(), name.size())),
+                  std::uint64_t(1) << id % 64, 1),
+        id(id), name(&name) {};
+  static base_expr_s create(std::string const &name) {
+    session &s = session::current();
+    expr_key key{tag};
+    key.symbol = s.intern_symbol(name);
+    return s.interned.get<variable>(key, key.symbol,
+                                    s.symbol_name(key.symbol));
   }
-  std::ostream &display(std::ostream &os) const override {
-    os << '(';
-    lhs->display(os);
-    os << " - ";
-    rhs->display(os);
-    os << ')';
-    return os;
+  base_expr_s derive(base_expr_s dv) {
+    variable const *other = expr_cast<variable>(dv);
+    return constant::create(other && other->id == id ? 1 : 0);
   }
-  ~sub() = default;
+  std::uint32_t symbol() const { return id; }
+  // The name, whichever session is current.
+  std::string const &label() const { return *name; }
 };
 
-class mul : public base_expr {
+// Flattened, canonical sum. create() splices nested sums, folds constants
+// and collects like terms (2x + 3x -> 5x) while ordering the operands.
+// Every intermediate sum is interned too, so long sums are best built from
+// one vector of terms rather than one term at a time.
+class add : public base_expr {
+private:
+  base_expr *const *args;
+  std::uint32_t count;
+
+public:
+  static constexpr expr_kind tag = expr_kind::add;
+
+  add(base_expr *const *args, std::uint32_t count)
+      : base_expr(tag, nary_hash(tag, args, count), nary_mask(args, count),
+                  sum_terms(args, count)),
+        args(args), count(count) {};
+  std::size_t size() const { return count; }
+  base_expr_s operand(std::size_t i) const { return args[i]; }
+
+  static base_expr_s create(base_expr_s lhs, base_expr_s rhs) {
+    return create(std::vector<base_expr_s>{lhs, rhs});
+  }
+  static base_expr_s create(std::vector<base_expr_s> const &terms);
+
+  base_expr_s derive(base_expr_s dv) {
+    std::vector<base_expr_s> terms;
+    terms.reserve(count);
+    for (std::uint32_t i = 0; i < count; ++i)
+      terms.push_back(args[i]->diff(dv));
+    return add::create(terms);
+  }
+};
+
+class sub : public base_expr {
+private:
   base_expr_s lhs;
   base_expr_s rhs;
 
 public:
-  mul(base_expr_s lhs, base_expr_s rhs) : lhs(lhs), rhs(rhs) {};
+  static constexpr expr_kind tag = expr_kind::sub;
+
+  sub(base_expr_s lhs, base_expr_s rhs)
+      : base_expr(tag, binary_hash(tag, lhs, rhs),
+                  lhs->var_mask() | rhs->var_mask(),
+                  sum_terms(lhs, rhs)),
+        lhs(lhs), rhs(rhs) {};
+  base_expr_s operand(std::size_t i) const { return i == 0 ? lhs : rhs; }
 
   static base_expr_s create(base_expr_s lhs, base_expr_s rhs) {
-    if (lhs->is_constant()) {
-      constant *lhs_p = dynamic_cast<constant *>(lhs.get());
-      if (lhs_p->value() == 0) {
-        return base_expr_s(new constant(0));
-      }
-      if (lhs_p->value() == 1) {
-        return rhs;
-      }
+    constant *lhs_p = expr_cast<constant>(lhs);
+    constant *rhs_p = expr_cast<constant>(rhs);
+    // Constants fold only to a finite value, which serialize can write
+    // back as a number; the rest stay as nodes.
+    if (lhs_p && rhs_p &&
+        std::isfinite(lhs_p->value() - rhs_p->value())) {
+      engine_stats::local().count(rewrite::constant_fold);
+      return constant::create(lhs_p->value() - rhs_p->value());
     }
-    if (rhs->is_constant()) {
-      constant *rhs_p = dynamic_cast<constant *>(rhs.get());
-      if (rhs_p->value() == 0) {
-        return base_expr_s(new constant(0));
-      }
-      if (rhs_p->value() == 1) {
-        return lhs;
-      }
+    if (rhs_p && rhs_p->value() == 0) {
+      engine_stats::local().count(rewrite::sub_zero);
+      return lhs;
     }
-    return base_expr_s(new mul(lhs, rhs));
+    if (lhs == rhs) {
+      engine_stats::local().count(rewrite::sub_self);
+      return constant::create(0);
+    }
+    return session::current().interned.get<sub>({tag, lhs, rhs}, lhs, rhs);
   }
 
-  virtual base_expr_s diff(base_expr_s be) override {
+  base_expr_s derive(base_expr_s be) {
     base_expr_s lhs_d(lhs->diff(be));
     base_expr_s rhs_d(rhs->diff(be));
 
-    return add::create(base_expr_s(mul::create(lhs, rhs_d)),
-                       base_expr_s(mul::create(lhs_d, rhs)));
+    return sub::create(lhs_d, rhs_d);
+  }
+};
+
+// Flattened, canonical product. create() splices nested products, folds
+// constants and merges powers of a common base (x * x^2 -> x^3).
+class mul : public base_expr {
+  base_expr *const *args;
+  std::uint32_t count;
+
+public:
+  static constexpr expr_kind tag = expr_kind::mul;
+
+  mul(base_expr *const *args, std::uint32_t count)
+      : base_expr(tag, nary_hash(tag, args, count), nary_mask(args, count),
+                  product_terms(args, count)),
+        args(args), count(count) {};
+  std::size_t size() const { return count; }
+  base_expr_s operand(std::size_t i) const { return args[i]; }
+
+  static base_expr_s create(base_expr_s lhs, base_expr_s rhs) {
+    return create(std::vector<base_expr_s>{lhs, rhs});
+  }
+  static base_expr_s create(std::vector<base_expr_s> const &factors);
+
+  // Splits off the constant factor, which canonical order puts first.
+  std::pair<std::double_t, base_expr_s> coefficient() {
+    constant *c = expr_cast<constant>(args[0]);
+    if (!c)
+      return {1, this};
+    if (count == 2)
+      return {c->value(), args[1]};
+    std::vector<base_expr_s> rest(args + 1, args + count);
+    return {c->value(), session::current().interned.get_nary<mul>(rest)};
+  }
+
+  // The product rule applied term by term copies the other n - 1 factors
+  // into each of n terms, and sorts each of them again. Longer products
+  // are split in half instead, taking d(l r) = d(l) r + l d(r). Each level
+  // of halving merges O(n) operands into products in all, so the whole
+  // derivative costs O(n log n) rather than the O(n^2) of folding the
+  // factors in one at a time. A run of factors of a canonical product is
+  // canonical itself and is interned as it is, without another sort.
+  static constexpr std::uint32_t split_min = 8;
+
+  base_expr_s derive(base_expr_s be) {
+    std::vector<base_expr_s> d(count);
+    for (std::uint32_t i = 0; i < count; ++i) {
+      d[i] = args[i]->diff(be);
+      if (constant *d_p = expr_cast<constant>(d[i]))
+        if (d_p->value() == 0)
+          d[i] = nullptr;
+    }
+    base_expr_s sum = derive_run(d, 0, count);
+    return sum ? sum : constant::create(0);
+  }
+
+private:
+  // The product of args[lo, hi).
+  base_expr_s run(std::uint32_t lo, std::uint32_t hi) {
+    if (hi - lo == 1)
+      return args[lo];
+    if (hi - lo == count)
+      return this;
+    std::vector<base_expr_s> ops(args + lo, args + hi);
+    return session::current().interned.get_nary<mul>(ops);
   }
 
-  std::ostream &display(std::ostream &os) const override {
-    os << '(';
-    lhs->display(os);
-    os << " * ";
-    rhs->display(os);
-    os << ')';
-    return os;
+  // The derivative of run(lo, hi) given those of the factors, or nullptr
+  // when it is zero.
+  base_expr_s derive_run(std::vector<base_expr_s> const &d, std::uint32_t lo,
+                         std::uint32_t hi) {
+    std::vector<base_expr_s> terms;
+    if (hi - lo < split_min) {
+      for (std::uint32_t i = lo; i < hi; ++i) {
+        if (!d[i])
+          continue;
+        std::vector<base_expr_s> factors(args + lo, args + hi);
+        factors[i - lo] = d[i];
+        terms.push_back(mul::create(factors));
+      }
+    } else {
+      std::uint32_t mid = lo + (hi - lo) / 2;
+      if (base_expr_s left = derive_run(d, lo, mid))
+        terms.push_back(mul::create(left, run(mid, hi)));
+      if (base_expr_s right = derive_run(d, mid, hi))
+        terms.push_back(mul::create(run(lo, mid), right));
+    }
+    return terms.empty() ? nullptr : add::create(terms);
   }
-  ~mul() = default;
 };
 
 class pow : public base_expr {
@@ -197,32 +949,38 @@ class pow : public base_expr {
   base_expr_s rhs;
 
 public:
-  pow(base_expr_s lhs, base_expr_s rhs) : lhs(lhs), rhs(rhs) {};
+  static constexpr expr_kind tag = expr_kind::pow;
+
+  pow(base_expr_s lhs, base_expr_s rhs)
+      : base_expr(tag, binary_hash(tag, lhs, rhs),
+                  lhs->var_mask() | rhs->var_mask(),
+                  lhs->terms() == 1 && is_natural(rhs)),
+        lhs(lhs), rhs(rhs) {};
+  base_expr_s operand(std::size_t i) const { return i == 0 ? lhs : rhs; }
 
   static base_expr_s create(base_expr_s lhs, base_expr_s rhs) {
-    if (!lhs->is_constant() && rhs->is_constant()) {
-      constant *rhs_p = dynamic_cast<constant *>(rhs.get());
+    constant *lhs_p = expr_cast<constant>(lhs);
+    constant *rhs_p = expr_cast<constant>(rhs);
+    // (-8)^0.5 and 10^400 have no finite value and are left unfolded.
+    if (lhs_p && rhs_p &&
+        std::isfinite(std::pow(lhs_p->value(), rhs_p->value()))) {
+      engine_stats::local().count(rewrite::constant_fold);
+      return constant::create(std::pow(lhs_p->value(), rhs_p->value()));
+    }
+    if (rhs_p) {
       if (rhs_p->value() == 0) {
-        return base_expr_s(new constant(1));
+        engine_stats::local().count(rewrite::pow_zero);
+        return constant::create(1);
       }
       if (rhs_p->value() == 1) {
+        engine_stats::local().count(rewrite::pow_one);
         return lhs;
       }
     }
-    return base_expr_s(new pow(lhs, rhs));
+    return session::current().interned.get<pow>({tag, lhs, rhs}, lhs, rhs);
   }
 
-  virtual base_expr_s diff(base_expr_s be) override;
-
-  std::ostream &display(std::ostream &os) const override {
-    os << '(';
-    lhs->display(os);
-    os << " ^ ";
-    rhs->display(os);
-    os << ')';
-    return os;
-  }
-  ~pow() = default;
+  base_expr_s derive(base_expr_s be);
 };
 
 class div : public base_expr {
@@ -230,112 +988,4415 @@ class div : public base_expr {
   base_expr_s rhs;
 
 public:
-  div(base_expr_s lhs, base_expr_s rhs) : lhs(lhs), rhs(rhs) {};
+  static constexpr expr_kind tag = expr_kind::div;
+
+  div(base_expr_s lhs, base_expr_s rhs)
+      : base_expr(tag, binary_hash(tag, lhs, rhs),
+                  lhs->var_mask() | rhs->var_mask(),
+                  rhs->is_constant() ? lhs->terms() : 0),
+        lhs(lhs), rhs(rhs) {};
+  base_expr_s operand(std::size_t i) const { return i == 0 ? lhs : rhs; }
 
   static base_expr_s create(base_expr_s lhs, base_expr_s rhs) {
-    if (rhs->is_constant()) {
-      constant *rhs_p = dynamic_cast<constant *>(rhs.get());
+    if (constant *rhs_p = expr_cast<constant>(rhs)) {
       if (rhs_p->value() == 0) {
         throw std::runtime_error("math error: attempted to divide by zero");
       }
       if (rhs_p->value() == 1) {
+        engine_stats::local().count(rewrite::div_one);
         return lhs;
       }
     }
-    if (lhs->is_constant()) {
-      constant *lhs_p = dynamic_cast<constant *>(lhs.get());
+    if (constant *lhs_p = expr_cast<constant>(lhs)) {
       if (lhs_p->value() == 0) {
-        return base_expr_s(new constant(0));
+        engine_stats::local().count(rewrite::div_zero);
+        return constant::create(0);
+      }
+      constant *rhs_p = expr_cast<constant>(rhs);
+      if (rhs_p && std::isfinite(lhs_p->value() / rhs_p->value())) {
+        engine_stats::local().count(rewrite::constant_fold);
+        return constant::create(lhs_p->value() / rhs_p->value());
       }
     }
-    return base_expr_s(new div(lhs, rhs));
+    return session::current().interned.get<div>({tag, lhs, rhs}, lhs, rhs);
   }
 
-  virtual base_expr_s diff(base_expr_s be) override {
+  base_expr_s derive(base_expr_s be) {
     base_expr_s lhs_d(lhs->diff(be));
     base_expr_s rhs_d(rhs->diff(be));
 
     return div::create(
-        sub::create(mul::create(lhs, rhs_d), mul::create(rhs_d, lhs)),
-        pow::create(rhs, base_expr_s(new constant(2))));
-  }
-
-  std::ostream &display(std::ostream &os) const override {
-    os << '(';
-    lhs->display(os);
-    os << " / ";
-    rhs->display(os);
-    os << ')';
-    return os;
+        sub::create(mul::create(lhs_d, rhs), mul::create(lhs, rhs_d)),
+        pow::create(rhs, constant::create(2)));
   }
-  ~div() = default;
 };
 
 class ln : public base_expr {
   base_expr_s value;
 
 public:
-  ln(base_expr_s value) : value(value) {};
+  static constexpr expr_kind tag = expr_kind::ln;
+
+  ln(base_expr_s value)
+      : base_expr(tag,
+                  hash_mix(static_cast<std::uint64_t>(tag), value->hash()),
+                  value->var_mask()),
+        value(value) {};
+  base_expr_s operand(std::size_t) const { return value; }
   static base_expr_s create(base_expr_s value) {
-    if (value->is_constant()) {
-      constant *value_p = dynamic_cast<constant *>(value.get());
+    if (constant *value_p = expr_cast<constant>(value)) {
       if (value_p->value() == 0) {
         throw std::runtime_error("math error: argument of ln is zero");
       }
       if (value_p->is_const_e()) {
-        return base_expr_s(new constant(1));
+        engine_stats::local().count(rewrite::ln_e);
+        return constant::create(1);
       }
     }
-    return base_expr_s(new ln(value));
+    return session::current().interned.get<ln>({tag, value}, value);
   }
-  virtual base_expr_s diff(base_expr_s be) override {
+  base_expr_s derive(base_expr_s be) {
     base_expr_s value_d(value->diff(be));
 
-    return mul::create(div::create(base_expr_s(new constant(1)), value),
-                       value_d);
+    return mul::create(div::create(constant::create(1), value), value_d);
+  }
+};
+
+// d(source)/d(dv), not built yet. Thunks stand in for the derivatives of
+// operands inside what lazy_diff() returns and expand one more level the
+// first time operand() hands them out, so only the parts of a derivative
+// that are printed, evaluated or differentiated again get built. The
+// expansion is kept in the node, and thunks are interned like other nodes,
+// so each (source, dv) expands at most once per session.
+class thunk : public base_expr {
+  base_expr_s source;
+  base_expr_s dv;
+  mutable std::atomic<base_expr *> forced{nullptr};
+
+public:
+  static constexpr expr_kind tag = expr_kind::thunk;
+
+  thunk(base_expr_s source, base_expr_s dv)
+      : base_expr(tag, binary_hash(tag, source, dv), source->var_mask()),
+        source(source), dv(dv) {};
+
+  // A thunk for d(source)/d(dv), or the derivative itself when it is
+  // already known to be zero or found in the cache.
+  static base_expr_s create(base_expr_s source, base_expr_s dv);
+
+  // The expansion: a node that is never a thunk, though its operands may
+  // be. Threads racing to expand build the same interned node.
+  base_expr_s force() const {
+    if (base_expr_s d = forced.load(std::memory_order_acquire))
+      return d;
+    engine_stats::local().forced.add();
+    bool &deferring = base_expr::deferring();
+    bool outer = deferring;
+    deferring = true;
+    base_expr_s d;
+    try {
+      d = source->derive(dv);
+    } catch (...) {
+      deferring = outer;
+      throw;
+    }
+    deferring = outer;
+    while (thunk *t = expr_cast<thunk>(d))
+      d = t->force();
+    forced.store(d, std::memory_order_release);
+    return d;
   }
 
-  std::ostream &display(std::ostream &os) const override {
-    os << " ln(";
-    value->display(os);
-    os << ')';
-    return os;
+  base_expr_s derive(base_expr_s be) { return force()->diff(be); }
+
+  base_expr_s subject() const { return source; }
+  base_expr_s wrt() const { return dv; }
+  // The expansion if it has been built, else nullptr.
+  base_expr_s expansion() const {
+    return forced.load(std::memory_order_acquire);
   }
-  ~ln() = default;
+
+  friend class session;
 };
 
-base_expr_s pow::diff(base_expr_s be) {
-  if (!lhs->is_constant() && rhs->is_constant()) {
-    base_expr_s lhs_d(lhs->diff(be));
-    constant *rhs_p = dynamic_cast<constant *>(rhs.get());
-    base_expr_s new_power(new constant(rhs_p->value() - 1));
-    return mul::create(mul::create(rhs, pow::create(lhs, new_power)), lhs_d);
+// e, or what it expands to when it is a thunk.
+inline base_expr_s resolve(base_expr_s e) {
+  thunk *t = expr_cast<thunk>(e);
+  return t ? t->force() : e;
+}
+
+// Whether d(e)/d(dv) can be nonzero: dv occurs in e, short of subtrees
+// whose variable mask misses dv or whose derivative is cached as zero. The
+// walk stops at the first occurrence, at a cached nonzero derivative and
+// at an existing thunk.
+bool depends_on(base_expr_s e, base_expr_s dv) {
+  session &s = session::current();
+  std::unordered_set<base_expr const *> seen{e};
+  std::vector<base_expr_s> stack{e};
+  while (!stack.empty()) {
+    base_expr_s node = stack.back();
+    stack.pop_back();
+    if (!(node->var_mask() & dv->var_mask()))
+      continue;
+    if (node == dv)
+      return true;
+    if (base_expr_s d = s.derivatives.find(node, dv)) {
+      if (d != s.zero)
+        return true;
+      continue;
+    }
+    if (s.interned.find({thunk::tag, node, dv}))
+      return true;
+    for (std::size_t i = 0; i < node->arity(); ++i)
+      if (seen.insert(node->operand(i)).second)
+        stack.push_back(node->operand(i));
   }
-  if (lhs->is_constant() && !rhs->is_constant()) {
-    base_expr_s rhs_d(rhs->diff(be));
-    return mul::create(mul::create(pow::create(lhs, rhs), ln::create(lhs)),
-                       rhs_d);
+  return false;
+}
+
+base_expr_s thunk::create(base_expr_s source, base_expr_s dv) {
+  session &s = session::current();
+  if (base_expr_s d = s.derivatives.find(source, dv))
+    return d;
+  expr_key key{tag, source, dv};
+  if (base_expr_s t = s.interned.find(key))
+    return t;
+  if (!depends_on(source, dv)) {
+    base_expr_s zero = constant::create(0);
+    s.derivatives.insert(source, dv, zero);
+    return zero;
   }
+  return s.interned.get<thunk>(key, source, dv);
 }
 
-int main(int argc, char *argv[]) {
-  base_expr_s x(new variable("x"));
-  base_expr_s c1(new constant(69));
-  base_expr_s c2(new constant(420));
-  base_expr_s c3(new constant(5));
-  base_expr_s c4(new constant(constant::E));
+// An operand of a sum or product seen as a key and a weight: term and
+// coefficient for add, base and exponent for mul. term is the original
+// operand, kept while the weight is unchanged so it need not be rebuilt.
+struct weighted_operand {
+  base_expr_s key;
+  std::double_t weight;
+  base_expr_s term;
+};
 
-  base_expr_s pow1(add::create(mul::create(c3, pow::create(x, c1)),
-                               mul::create(c3, pow::create(x, c2))));
-  base_expr_s pow2(pow::create(c3, mul::create(c1, x)));
-  base_expr_s pow3(pow::create(c4, mul::create(c1, x)));
+// The operands of a would-be T node in canonical key order, with nested T
+// nodes spliced in, equal keys combined and constants passed to fold.
+// Operands of an existing node are already sorted and are merged as one
+// run, so adding a term to a large sum costs linear time, not a sort.
+template <typename T, typename Split, typename Fold>
+std::vector<weighted_operand>
+collect_operands(std::vector<base_expr_s> const &inputs, Split split,
+                 Fold fold) {
+  auto key_less = [](weighted_operand const &a, weighted_operand const &b) {
+    return canonical_less(a.key, b.key);
+  };
+  std::vector<weighted_operand> ops;
+  std::vector<weighted_operand> loose;
+  std::vector<std::size_t> runs;
+  for (base_expr_s input : inputs) {
+    if (constant *c = expr_cast<constant>(input)) {
+      fold(c->value());
+    } else if (T *nested = expr_cast<T>(input)) {
+      runs.push_back(ops.size());
+      for (std::size_t i = 0; i < nested->size(); ++i) {
+        base_expr_s e = nested->operand(i);
+        if (constant *c = expr_cast<constant>(e))
+          fold(c->value());
+        else
+          ops.push_back(split(e));
+      }
+    } else {
+      loose.push_back(split(input));
+    }
+  }
+  std::sort(loose.begin(), loose.end(), key_less);
+  runs.push_back(ops.size());
+  ops.insert(ops.end(), loose.begin(), loose.end());
+  for (std::size_t r = 1; r < runs.size(); ++r) {
+    auto end = r + 1 < runs.size() ? ops.begin() + runs[r + 1] : ops.end();
+    std::inplace_merge(ops.begin(), ops.begin() + runs[r], end, key_less);
+  }
 
-  base_expr_s pow1d(pow1->diff(x));
-  base_expr_s pow2d(pow2->diff(x));
-  base_expr_s pow3d(pow3->diff(x));
+  std::vector<weighted_operand> combined;
+  for (weighted_operand const &op : ops) {
+    // Weights that would overflow are kept apart, so that no coefficient
+    // or exponent is built that serialize cannot write as a number.
+    if (!combined.empty() && combined.back().key == op.key &&
+        std::isfinite(combined.back().weight + op.weight)) {
+      engine_stats::local().count(rewrite::like_terms);
+      combined.back().weight += op.weight;
+      combined.back().term = nullptr;
+    } else {
+      combined.push_back(op);
+    }
+  }
+  return combined;
+}
 
-  std::cout << *pow1 << "\t:\t" << *pow1d << std::endl;
+base_expr_s add::create(std::vector<base_expr_s> const &terms) {
+  // Constants that would overflow the folded one are kept as operands.
+  std::double_t folded = 0;
+  bool constants = false;
+  std::vector<base_expr_s> spilled;
+  std::vector<weighted_operand> collected = collect_operands<add>(
+      terms,
+      [](base_expr_s term) {
+        if (mul *m = expr_cast<mul>(term)) {
+          auto [coeff, rest] = m->coefficient();
+          return weighted_operand{rest, coeff, term};
+        }
+        return weighted_operand{term, 1, term};
+      },
+      [&](std::double_t c) {
+        constants = true;
+        if (std::isfinite(folded + c))
+          folded += c;
+        else
+          spilled.push_back(constant::create(c));
+      });
+
+  if (constants && folded == 0 && !collected.empty())
+    engine_stats::local().count(rewrite::add_zero);
+  std::vector<base_expr_s> ops;
+  if (folded != 0)
+    ops.push_back(constant::create(folded));
+  ops.insert(ops.end(), spilled.begin(), spilled.end());
+  // Set when like terms combined into a bare sum, as 2(x + y) - (x + y)
+  // does, which must be spliced in turn.
+  bool nested = false;
+  for (weighted_operand const &op : collected) {
+    if (op.weight == 0)
+      continue;
+    if (op.term) {
+      ops.push_back(op.term);
+    } else if (op.weight == 1) {
+      nested = nested || expr_cast<add>(op.key);
+      ops.push_back(op.key);
+    } else {
+      ops.push_back(mul::create(constant::create(op.weight), op.key));
+    }
+  }
+  if (nested)
+    return create(ops);
+  if (ops.size() <= 1) {
+    engine_stats::local().count(rewrite::collapse);
+    return ops.empty() ? constant::create(0) : ops[0];
+  }
+  return session::current().interned.get_nary<add>(ops);
+}
+
+// A factor as a base and its constant exponent.
+inline weighted_operand split_factor(base_expr_s factor) {
+  if (class pow *p = expr_cast<class pow>(factor))
+    if (constant *e = expr_cast<constant>(p->operand(1)))
+      return weighted_operand{p->operand(0), e->value(), factor};
+  return weighted_operand{factor, 1, factor};
+}
+
+base_expr_s mul::create(std::vector<base_expr_s> const &factors) {
+  // As in add::create, constants that would overflow are kept apart.
+  std::double_t folded = 1;
+  bool constants = false;
+  std::vector<base_expr_s> spilled;
+  std::vector<weighted_operand> collected =
+      collect_operands<mul>(factors, split_factor, [&](std::double_t c) {
+        constants = true;
+        if (std::isfinite(folded * c))
+          folded *= c;
+        else
+          spilled.push_back(constant::create(c));
+      });
+  if (folded == 0) {
+    engine_stats::local().count(rewrite::mul_zero);
+    return constant::create(0);
+  }
+  if (constants && folded == 1 && !collected.empty())
+    engine_stats::local().count(rewrite::mul_one);
+
+  std::vector<base_expr_s> ops;
+  if (folded != 1)
+    ops.push_back(constant::create(folded));
+  ops.insert(ops.end(), spilled.begin(), spilled.end());
+  // As in add::create, for powers of a product that combine to its first
+  // power.
+  bool nested = false;
+  for (weighted_operand const &op : collected) {
+    if (op.weight == 0)
+      continue;
+    if (op.term) {
+      ops.push_back(op.term);
+    } else if (op.weight == 1) {
+      nested = nested || expr_cast<mul>(op.key);
+      ops.push_back(op.key);
+    } else {
+      ops.push_back(pow::create(op.key, constant::create(op.weight)));
+    }
+  }
+  if (nested)
+    return create(ops);
+  if (ops.size() <= 1) {
+    engine_stats::local().count(rewrite::collapse);
+    return ops.empty() ? constant::create(1) : ops[0];
+  }
+  return session::current().interned.get_nary<mul>(ops);
+}
+
+base_expr_s pow::derive(base_expr_s be) {
+  if (!lhs->is_constant() && rhs->is_constant()) {
+    base_expr_s lhs_d(lhs->diff(be));
+    constant *rhs_p = static_cast<constant *>(rhs);
+    base_expr_s new_power(constant::create(rhs_p->value() - 1));
+    return mul::create(mul::create(rhs, pow::create(lhs, new_power)), lhs_d);
+  }
+  if (lhs->is_constant() && !rhs->is_constant()) {
+    base_expr_s rhs_d(rhs->diff(be));
+    return mul::create(mul::create(pow::create(lhs, rhs), ln::create(lhs)),
+                       rhs_d);
+  }
+  if (lhs->is_constant() && rhs->is_constant()) {
+    return constant::create(0);
+  }
+  // d(u^v) = u^v * (v' ln(u) + v u' / u)
+  base_expr_s lhs_d(lhs->diff(be));
+  base_expr_s rhs_d(rhs->diff(be));
+  return mul::create(
+      this, add::create(mul::create(rhs_d, ln::create(lhs)),
+                        div::create(mul::create(rhs, lhs_d), lhs)));
+}
+
+base_expr_s base_expr::derive(base_expr_s dv) {
+  switch (kind_tag) {
+  case expr_kind::constant:
+    return static_cast<constant *>(this)->derive(dv);
+  case expr_kind::variable:
+    return static_cast<variable *>(this)->derive(dv);
+  case expr_kind::add:
+    return static_cast<add *>(this)->derive(dv);
+  case expr_kind::sub:
+    return static_cast<sub *>(this)->derive(dv);
+  case expr_kind::mul:
+    return static_cast<mul *>(this)->derive(dv);
+  case expr_kind::div:
+    return static_cast<class div *>(this)->derive(dv);
+  case expr_kind::pow:
+    return static_cast<class pow *>(this)->derive(dv);
+  case expr_kind::ln:
+    return static_cast<ln *>(this)->derive(dv);
+  case expr_kind::thunk:
+    return static_cast<thunk *>(this)->derive(dv);
+  }
+  throw std::logic_error("unknown expression kind");
+}
+
+std::size_t base_expr::arity() const {
+  switch (kind_tag) {
+  case expr_kind::constant:
+  case expr_kind::variable:
+  case expr_kind::thunk:
+    return 0;
+  case expr_kind::ln:
+    return 1;
+  case expr_kind::add:
+    return static_cast<add const *>(this)->size();
+  case expr_kind::mul:
+    return static_cast<mul const *>(this)->size();
+  default:
+    return 2;
+  }
+}
+
+// Thunks among the operands are expanded on the way out, so traversals
+// only ever see built nodes.
+base_expr_s base_expr::operand(std::size_t i) const {
+  base_expr_s child;
+  switch (kind_tag) {
+  case expr_kind::add:
+    child = static_cast<add const *>(this)->operand(i);
+    break;
+  case expr_kind::sub:
+    child = static_cast<sub const *>(this)->operand(i);
+    break;
+  case expr_kind::mul:
+    child = static_cast<mul const *>(this)->operand(i);
+    break;
+  case expr_kind::div:
+    child = static_cast<class div const *>(this)->operand(i);
+    break;
+  case expr_kind::pow:
+    child = static_cast<class pow const *>(this)->operand(i);
+    break;
+  case expr_kind::ln:
+    child = static_cast<ln const *>(this)->operand(i);
+    break;
+  default:
+    throw std::out_of_range("leaf expressions have no operands");
+  }
+  return resolve(child);
+}
+
+enum class print_format { infix, sexpr };
+
+// How tightly e binds as printed in infix: sums, products, negative
+// constants, powers, atoms.
+inline int infix_level(base_expr const *e) {
+  switch (e->kind()) {
+  case expr_kind::add:
+  case expr_kind::sub:
+    return 1;
+  case expr_kind::mul:
+  case expr_kind::div:
+    return 2;
+  case expr_kind::pow:
+    return 4;
+  case expr_kind::constant:
+    return std::signbit(static_cast<constant const *>(e)->value()) ? 3 : 5;
+  default:
+    return 5;
+  }
+}
+
+// The level operand i of e needs to go without parentheses. Infix
+// operators group to the left, so every operand but the first must bind
+// tighter than e itself; ^ groups to the right and takes a signed exponent.
+inline int operand_level(base_expr const *e, std::size_t i) {
+  switch (e->kind()) {
+  case expr_kind::add:
+  case expr_kind::sub:
+    return i == 0 ? 1 : 2;
+  case expr_kind::mul:
+  case expr_kind::div:
+    return i == 0 ? 2 : 3;
+  case expr_kind::pow:
+    return i == 0 ? 5 : 3;
+  default:
+    return 0;
+  }
+}
+
+inline char const *operator_name(expr_kind kind) {
+  switch (kind) {
+  case expr_kind::add:
+    return "+";
+  case expr_kind::sub:
+    return "-";
+  case expr_kind::mul:
+    return "*";
+  case expr_kind::div:
+    return "/";
+  case expr_kind::pow:
+    return "^";
+  case expr_kind::ln:
+    return "ln";
+  default:
+    return "";
+  }
+}
+
+// Appends root to out in one explicit-stack pass. Infix output carries
+// only the parentheses precedence requires and reads back through parser
+// to the same expression; sexpr writes (op operand...) lists. Numbers are
+// written in their shortest round-trip form.
+void serialize(base_expr const *root, std::string &out,
+               print_format format = print_format::infix) {
+  bool infix = format == print_format::infix;
+  struct frame {
+    base_expr const *node;
+    std::size_t next;
+    bool parens;
+  };
+  std::vector<frame> stack;
+
+  auto open = [&](base_expr const *e, bool parens) {
+    if (parens)
+      out += '(';
+    if (e->kind() == expr_kind::constant) {
+      char buf[32];
+      auto r = std::to_chars(buf, buf + sizeof buf,
+                             static_cast<constant const *>(e)->value());
+      out.append(buf, r.ptr);
+    } else if (e->kind() == expr_kind::variable) {
+      out += static_cast<variable const *>(e)->label();
+    } else {
+      if (!infix) {
+        out += '(';
+        out += operator_name(e->kind());
+      } else if (e->kind() == expr_kind::ln) {
+        out += "ln(";
+      }
+      stack.push_back({e, 0, parens});
+      return;
+    }
+    if (parens)
+      out += ')';
+  };
+
+  open(root, false);
+  while (!stack.empty()) {
+    frame &f = stack.back();
+    base_expr const *node = f.node;
+    if (f.next == node->arity()) {
+      if (!infix || node->kind() == expr_kind::ln)
+        out += ')';
+      if (f.parens)
+        out += ')';
+      stack.pop_back();
+      continue;
+    }
+    std::size_t i = f.next++;
+    if (!infix) {
+      out += ' ';
+    } else if (i > 0) {
+      bool spaced =
+          node->kind() == expr_kind::add || node->kind() == expr_kind::sub;
+      if (spaced)
+        out += ' ';
+      out += operator_name(node->kind());
+      if (spaced)
+        out += ' ';
+    }
+    base_expr const *child = node->operand(i);
+    open(child, infix && infix_level(child) < operand_level(node, i));
+  }
+}
+
+std::ostream &base_expr::display(std::ostream &os) const {
+  std::string out;
+  serialize(this, out);
+  return os << out;
+}
+
+// Every node reachable from the roots exactly once, children before parents.
+// Walks the DAG with an explicit stack so depth is not bounded by the native
+// one.
+std::vector<base_expr_s> topo_order(std::vector<base_expr_s> const &roots) {
+  std::vector<base_expr_s> order;
+  std::unordered_set<base_expr const *> seen;
+  std::vector<std::pair<base_expr_s, std::size_t>> stack;
+  for (base_expr_s root : roots) {
+    if (!seen.insert(root).second)
+      continue;
+    stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+      auto &[node, next] = stack.back();
+      if (next < node->arity()) {
+        base_expr_s child = node->operand(next++);
+        if (seen.insert(child).second)
+          stack.emplace_back(child, 0);
+        continue;
+      }
+      order.push_back(node);
+      stack.pop_back();
+    }
+  }
+  return order;
+}
+
+// A node of e's kind over new operands, built through its factory so the
+// result is simplified and interned like any other.
+base_expr_s rebuild(base_expr_s e, std::vector<base_expr_s> const &ops) {
+  switch (e->kind()) {
+  case expr_kind::add:
+    return add::create(ops);
+  case expr_kind::mul:
+    return mul::create(ops);
+  case expr_kind::sub:
+    return sub::create(ops[0], ops[1]);
+  case expr_kind::div:
+    return div::create(ops[0], ops[1]);
+  case expr_kind::pow:
+    return pow::create(ops[0], ops[1]);
+  case expr_kind::ln:
+    return ln::create(ops[0]);
+  default:
+    return e;
+  }
+}
+
+// An expression under edit. The editor keeps every node's parents and
+// height, so replace() finds the nodes above an edit without walking the
+// whole expression and rebuilds just those, children first. Everything
+// else is shared with the old version, and since derivatives are cached
+// by node, diff() on the new root only derives the rebuilt path; see also
+// tape::update(). Nodes are reference counted by their parents, so
+// versions left behind drop out of the maps.
+class expr_editor {
+private:
+  struct node_info {
+    std::vector<base_expr_s> parents;
+    std::uint32_t height = 0;
+    std::uint32_t uses = 0;
+  };
+
+  base_expr_s root;
+  std::unordered_map<base_expr const *, node_info> nodes;
+
+  // The distinct operands of e, in no particular order; a parent is
+  // listed once per child.
+  static std::vector<base_expr_s> children(base_expr_s e) {
+    std::vector<base_expr_s> out;
+    for (std::size_t i = 0; i < e->arity(); ++i)
+      out.push_back(e->operand(i));
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+  }
+
+  // Counts one more reference to e, first registering e and whatever
+  // under it is new.
+  void acquire(base_expr_s e) {
+    std::vector<std::pair<base_expr_s, bool>> stack{{e, false}};
+    while (!stack.empty()) {
+      auto [node, expanded] = stack.back();
+      if (nodes.count(node)) {
+        stack.pop_back();
+        continue;
+      }
+      if (!expanded) {
+        stack.back().second = true;
+        for (base_expr_s c : children(node))
+          if (!nodes.count(c))
+            stack.emplace_back(c, false);
+        continue;
+      }
+      stack.pop_back();
+      node_info &info = nodes[node];
+      for (base_expr_s c : children(node)) {
+        node_info &child = nodes.at(c);
+        child.parents.push_back(node);
+        ++child.uses;
+        info.height = std::max(info.height, child.height + 1);
+      }
+    }
+    ++nodes.at(e).uses;
+  }
+
+  // Drops a reference to e, unregistering nodes nothing uses any more.
+  void release(base_expr_s e) {
+    std::vector<base_expr_s> stack{e};
+    while (!stack.empty()) {
+      base_expr_s node = stack.back();
+      stack.pop_back();
+      auto it = nodes.find(node);
+      if (--it->second.uses > 0)
+        continue;
+      nodes.erase(it);
+      for (base_expr_s c : children(node)) {
+        std::vector<base_expr_s> &up = nodes.at(c).parents;
+        up.erase(std::find(up.begin(), up.end(), node));
+        stack.push_back(c);
+      }
+    }
+  }
+
+public:
+  explicit expr_editor(base_expr_s root) : root(root) { acquire(root); }
+  expr_editor(expr_editor const &) = delete;
+  expr_editor &operator=(expr_editor const &) = delete;
+
+  base_expr_s expr() const { return root; }
+  bool contains(base_expr_s e) const { return nodes.count(e) > 0; }
+
+  std::vector<base_expr_s> const &parents(base_expr_s e) const {
+    return nodes.at(e).parents;
+  }
+
+  // Replaces every occurrence of target with replacement and returns the
+  // new root. Only target's ancestors are rebuilt.
+  base_expr_s replace(base_expr_s target, base_expr_s replacement) {
+    if (target == replacement || !nodes.count(target))
+      return root;
+    std::vector<base_expr_s> dirty{target};
+    std::unordered_set<base_expr const *> seen{target};
+    for (std::size_t i = 0; i < dirty.size(); ++i)
+      for (base_expr_s p : nodes.at(dirty[i]).parents)
+        if (seen.insert(p).second)
+          dirty.push_back(p);
+    // A parent is always higher than its children, so target stays first.
+    std::sort(dirty.begin(), dirty.end(), [&](base_expr_s a, base_expr_s b) {
+      return nodes.at(a).height < nodes.at(b).height;
+    });
+
+    std::unordered_map<base_expr const *, base_expr_s> fresh{
+        {target, replacement}};
+    std::vector<base_expr_s> ops;
+    for (auto it = dirty.begin() + 1; it != dirty.end(); ++it) {
+      base_expr_s node = *it;
+      ops.clear();
+      for (std::size_t i = 0; i < node->arity(); ++i) {
+        base_expr_s c = node->operand(i);
+        auto found = fresh.find(c);
+        ops.push_back(found == fresh.end() ? c : found->second);
+      }
+      fresh.emplace(node, rebuild(node, ops));
+    }
+
+    base_expr_s old = root;
+    root = fresh.at(root);
+    acquire(root);
+    release(old);
+    return root;
+  }
+};
+
+// Every partial derivative of expr, one per entry of vars, from a single
+// reverse (adjoint) sweep over the DAG. Each node's adjoint is built once
+// and handed to its children, so the partials share their common terms
+// instead of re-walking the expression once per variable.
+std::vector<base_expr_s> gradient(base_expr_s expr,
+                                  std::vector<base_expr_s> const &vars) {
+  std::vector<base_expr_s> order = topo_order({expr});
+
+  // Only subtrees that reach one of vars receive an adjoint.
+  std::unordered_set<base_expr const *> live(vars.begin(), vars.end());
+  for (base_expr_s node : order) {
+    for (std::size_t i = 0; i < node->arity(); ++i) {
+      if (live.count(node->operand(i))) {
+        live.insert(node);
+        break;
+      }
+    }
+  }
+
+  // Contributions are built lazily, only for children that need them.
+  std::unordered_map<base_expr const *, base_expr_s> adjoint;
+  auto accumulate = [&](base_expr_s node, auto contribution) {
+    if (!live.count(node))
+      return;
+    auto [it, fresh] = adjoint.emplace(node, nullptr);
+    base_expr_s c = contribution();
+    it->second = fresh ? c : add::create(it->second, c);
+  };
+  accumulate(expr, [] { return constant::create(1); });
+
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    base_expr_s node = *it;
+    auto found = adjoint.find(node);
+    if (found == adjoint.end() || node->arity() == 0)
+      continue;
+    base_expr_s a = found->second;
+    base_expr_s lhs = node->operand(0);
+    base_expr_s rhs = node->arity() > 1 ? node->operand(1) : nullptr;
+
+    switch (node->kind()) {
+    case expr_kind::add:
+      for (std::size_t i = 0; i < node->arity(); ++i)
+        accumulate(node->operand(i), [&] { return a; });
+      break;
+    case expr_kind::sub:
+      accumulate(lhs, [&] { return a; });
+      accumulate(rhs, [&] { return mul::create(constant::create(-1), a); });
+      break;
+    case expr_kind::mul:
+      for (std::size_t i = 0; i < node->arity(); ++i) {
+        accumulate(node->operand(i), [&] {
+          std::vector<base_expr_s> others{a};
+          for (std::size_t j = 0; j < node->arity(); ++j)
+            if (j != i)
+              others.push_back(node->operand(j));
+          return mul::create(others);
+        });
+      }
+      break;
+    case expr_kind::div:
+      // d(u/v) = du / v - (u/v) dv / v
+      accumulate(lhs, [&] { return div::create(a, rhs); });
+      accumulate(rhs, [&] {
+        return mul::create(constant::create(-1),
+                           div::create(mul::create(a, node), rhs));
+      });
+      break;
+    case expr_kind::pow:
+      if (constant *rhs_p = expr_cast<constant>(rhs)) {
+        accumulate(lhs, [&] {
+          base_expr_s new_power(constant::create(rhs_p->value() - 1));
+          return mul::create(a, mul::create(rhs, pow::create(lhs, new_power)));
+        });
+        break;
+      }
+      accumulate(lhs, [&] {
+        return mul::create(a, div::create(mul::create(rhs, node), lhs));
+      });
+      accumulate(rhs, [&] {
+        return mul::create(a, mul::create(node, ln::create(lhs)));
+      });
+      break;
+    case expr_kind::ln:
+      accumulate(lhs, [&] { return div::create(a, lhs); });
+      break;
+    default:
+      break;
+    }
+  }
+
+  std::vector<base_expr_s> partials;
+  for (base_expr_s v : vars) {
+    auto found = adjoint.find(v);
+    partials.push_back(found == adjoint.end() ? constant::create(0)
+                                              : found->second);
+  }
+  return partials;
+}
+
+// f, f', ..., f^(k) with respect to dv. Rather than applying diff() k times,
+// which doubles the terms of every product at each step, this propagates
+// the derivatives f^(0..k) of every node through the DAG with Leibniz
+// rules, whose coefficients are binomials. Every rule only combines lower
+// orders of the same node and its children, so the output grows as
+// O(k^2) per node. Only quotients, ln and powers with an exponent in dv
+// divide, by the value of their denominator or base, where they are
+// singular anyway; powers whose base is zero stay finite where they are.
+// Differences and quotients are built as sums and products, so that
+// factors cancel.
+std::vector<base_expr_s> derivatives(base_expr_s expr, base_expr_s dv,
+                                     std::size_t k) {
+  using series = std::vector<base_expr_s>;
+  auto num = [](std::double_t c) { return constant::create(c); };
+  auto zero = constant::create(0);
+  auto minus = [&](base_expr_s a, base_expr_s b) {
+    return add::create(a, mul::create(num(-1), b));
+  };
+  auto over = [&](base_expr_s a, base_expr_s b) {
+    return b->is_constant() ? div::create(a, b)
+                            : mul::create(a, pow::create(b, num(-1)));
+  };
+  // binom[n][i] = C(n, i) for n <= k.
+  std::vector<std::vector<std::double_t>> binom(k + 1);
+  for (std::size_t n = 0; n <= k; ++n) {
+    binom[n].assign(n + 1, 1);
+    for (std::size_t i = 1; i < n; ++i)
+      binom[n][i] = binom[n - 1][i - 1] + binom[n - 1][i];
+  }
+  // sum over i in [from, to] of C(n, i) a_i b_{n-i+shift}
+  auto leibniz = [&](std::size_t n, std::size_t from, std::size_t to,
+                     series const &a, series const &b, std::size_t shift) {
+    std::vector<base_expr_s> terms;
+    for (std::size_t i = from; i <= to; ++i)
+      terms.push_back(mul::create(
+          {num(binom[n][i]), a[i], b[n - i + shift]}));
+    return add::create(terms);
+  };
+  // w = exp(z) given the derivatives of z, from w' = z' w.
+  auto exp_of = [&](series &w, series const &z) {
+    series dz(z.begin() + 1, z.end());
+    for (std::size_t j = 1; j <= k; ++j)
+      w[j] = leibniz(j - 1, 0, j - 1, dz, w, 0);
+  };
+  // z = ln(s), from q = z' = s' / s: s q = s', so
+  // q^(n) = (s^(n+1) - sum_{i>0} C(n, i) s^(i) q^(n-i)) / s.
+  auto ln_of = [&](series const &s) {
+    series z(k + 1, zero);
+    z[0] = ln::create(s[0]);
+    series q(k, zero);
+    for (std::size_t n = 0; n < k; ++n) {
+      q[n] = over(minus(s[n + 1], n ? leibniz(n, 1, n, s, q, 0) : zero),
+                  s[0]);
+      z[n + 1] = q[n];
+    }
+    return z;
+  };
+
+  std::unordered_map<base_expr const *, series> orders;
+  for (base_expr_s node : topo_order({expr})) {
+    series w(k + 1, zero);
+    w[0] = node;
+    if (node->arity() == 0) {
+      if (node == dv && k > 0)
+        w[1] = num(1);
+      orders.emplace(node, std::move(w));
+      continue;
+    }
+    series const &u = orders.at(node->operand(0));
+    series const &v = orders.at(node->operand(node->arity() - 1));
+
+    switch (node->kind()) {
+    case expr_kind::add:
+      for (std::size_t j = 1; j <= k; ++j) {
+        std::vector<base_expr_s> terms;
+        for (std::size_t i = 0; i < node->arity(); ++i)
+          terms.push_back(orders.at(node->operand(i))[j]);
+        w[j] = add::create(terms);
+      }
+      break;
+    case expr_kind::sub:
+      for (std::size_t j = 1; j <= k; ++j)
+        w[j] = minus(u[j], v[j]);
+      break;
+    case expr_kind::mul: {
+      // Fold the operands in one at a time, each step a Leibniz product.
+      series acc = u;
+      for (std::size_t f = 1; f < node->arity(); ++f) {
+        series const &t = orders.at(node->operand(f));
+        series next(k + 1, zero);
+        for (std::size_t j = 0; j <= k; ++j)
+          next[j] = leibniz(j, 0, j, acc, t, 0);
+        acc = std::move(next);
+      }
+      std::copy(acc.begin() + 1, acc.end(), w.begin() + 1);
+      break;
+    }
+    case expr_kind::div:
+      // v w = u, so w^(j) = (u^(j) - sum_{i>0} C(j, i) v^(i) w^(j-i)) / v.
+      // The value enters as a product too, for the same reason.
+      w[0] = over(u[0], v[0]);
+      for (std::size_t j = 1; j <= k; ++j)
+        w[j] = over(minus(u[j], leibniz(j, 1, j, v, w, 0)), v[0]);
+      w[0] = node;
+      break;
+    case expr_kind::pow:
+      if (std::all_of(v.begin() + 1, v.end(),
+                      [&](base_expr_s d) { return d == zero; })) {
+        // For an exponent c that does not depend on dv, p_r = u^(c-r) has
+        // p_r' = (c - r) p_{r+1} u', and p_r is needed up to order k - r.
+        // The last one needed is u^0 = 1 when c is a natural number up to
+        // k, else just the value u^(c-k). Nothing divides by u, so natural
+        // powers stay finite where u is zero.
+        base_expr_s c = node->operand(1);
+        std::size_t last = k;
+        if (is_natural(c) && static_cast<constant *>(c)->value() < k)
+          last = static_cast<std::size_t>(static_cast<constant *>(c)->value());
+        auto less = [&](std::size_t r) {
+          return add::create(c, num(-static_cast<std::double_t>(r)));
+        };
+        series p(k + 1, zero);
+        p[0] = pow::create(u[0], less(last));
+        series du(u.begin() + 1, u.end());
+        for (std::size_t r = last; r-- > 0;) {
+          series next(k + 1, zero);
+          next[0] = pow::create(u[0], less(r));
+          for (std::size_t j = 1; j <= k - r; ++j)
+            next[j] = mul::create(less(r), leibniz(j - 1, 0, j - 1, p, du, 0));
+          p = std::move(next);
+        }
+        std::copy(p.begin() + 1, p.end(), w.begin() + 1);
+      } else if (node->operand(0)->is_constant()) {
+        series z(k + 1, zero);
+        for (std::size_t j = 1; j <= k; ++j)
+          z[j] = mul::create(v[j], ln::create(node->operand(0)));
+        exp_of(w, z);
+      } else {
+        series lu = ln_of(u);
+        series z(k + 1, zero);
+        for (std::size_t j = 1; j <= k; ++j)
+          z[j] = leibniz(j, 0, j, v, lu, 0);
+        exp_of(w, z);
+      }
+      break;
+    case expr_kind::ln:
+      w = ln_of(u);
+      w[0] = node;
+      break;
+    default:
+      break;
+    }
+    orders.emplace(node, std::move(w));
+  }
+  return orders.at(expr);
+}
+
+// A sparse multivariate polynomial: coefficient per monomial, over
+// the variables of the subtree it was read from. Polynomial subtrees are
+// differentiated in this form, term by term, and only turned back into
+// nodes at the boundary.
+class polynomial {
+public:
+  // (variable index, exponent) pairs, sorted by index, with no zero
+  // exponents, so a monomial costs only the variables it has.
+  using monomial = std::vector<std::pair<std::uint32_t, std::uint32_t>>;
+
+private:
+  std::shared_ptr<std::vector<base_expr_s> const> vars;
+  std::map<monomial, std::double_t> terms;
+
+  polynomial(std::shared_ptr<std::vector<base_expr_s> const> vars)
+      : vars(std::move(vars)) {};
+
+  void add_term(monomial const &m, std::double_t c) {
+    std::double_t &slot = terms[m];
+    slot += c;
+    if (slot == 0)
+      terms.erase(m);
+  }
+
+  // The product, or nothing when an exponent would overflow.
+  std::optional<polynomial> times(polynomial const &other) const {
+    polynomial out(vars);
+    monomial m;
+    for (auto const &[m1, c1] : terms) {
+      for (auto const &[m2, c2] : other.terms) {
+        // Merges the two sorted lists, adding exponents of shared indexes.
+        m.clear();
+        auto a = m1.begin(), b = m2.begin();
+        while (a != m1.end() || b != m2.end()) {
+          if (b == m2.end() || (a != m1.end() && a->first < b->first)) {
+            m.push_back(*a++);
+          } else if (a == m1.end() || b->first < a->first) {
+            m.push_back(*b++);
+          } else {
+            if (b->second > UINT32_MAX - a->second)
+              return std::nullopt;
+            m.emplace_back(a->first, a->second + b->second);
+            ++a;
+            ++b;
+          }
+        }
+        out.add_term(m, c1 * c2);
+      }
+    }
+    return out;
+  }
+
+public:
+  // Whether root is a polynomial whose expansion never needs more terms
+  // than the subtree has nodes, so the coefficient form is never the
+  // bigger one. The walk stops as soon as it has seen enough nodes. When
+  // it does not, every node it saw whose bound exceeds the whole walk
+  // cannot fit either and is added to refused, so the nodes below a
+  // refused one are not walked again one by one.
+  static bool fits(base_expr_s root,
+                   std::unordered_set<base_expr const *> &refused) {
+    if (!root->is_polynomial() || refused.count(root))
+      return false;
+    std::size_t limit = root->terms();
+    std::unordered_set<base_expr const *> seen{root};
+    std::vector<base_expr_s> stack{root};
+    while (!stack.empty() && seen.size() < limit) {
+      base_expr_s node = stack.back();
+      stack.pop_back();
+      for (std::size_t i = 0; i < node->arity(); ++i)
+        if (seen.insert(node->operand(i)).second)
+          stack.push_back(node->operand(i));
+    }
+    if (seen.size() >= limit)
+      return true;
+    for (base_expr const *node : seen)
+      if (node->terms() > seen.size())
+        refused.insert(node);
+    return false;
+  }
+
+  // Expands root, which must be a polynomial. Products only distribute
+  // one sum over monomials and powers only raise monomials, so the
+  // coefficients are taken straight from the input and never multiplied
+  // out. Returns false and leaves out untouched if an exponent does not
+  // fit in 32 bits.
+  static bool from_expr(base_expr_s root, std::optional<polynomial> &out) {
+    std::vector<base_expr_s> order = topo_order({root});
+    auto vars = std::make_shared<std::vector<base_expr_s>>();
+    std::unordered_map<base_expr const *, std::uint32_t> index;
+    for (base_expr_s node : order) {
+      if (node->kind() == expr_kind::variable) {
+        index.emplace(node, static_cast<std::uint32_t>(vars->size()));
+        vars->push_back(node);
+      }
+    }
+
+    // A child expansion used by a single parent is moved rather than copied,
+    // which keeps long sum chains linear.
+    std::unordered_map<base_expr const *, std::size_t> uses;
+    for (base_expr_s node : order)
+      for (std::size_t i = 0; i < node->arity(); ++i)
+        ++uses[node->operand(i)];
+    std::unordered_map<base_expr const *, polynomial> expanded;
+    auto take = [&](base_expr_s child) {
+      polynomial &p = expanded.at(child);
+      return --uses[child] == 0 ? std::move(p) : p;
+    };
+
+    for (base_expr_s node : order) {
+      polynomial p(vars);
+      switch (node->kind()) {
+      case expr_kind::constant:
+        p.add_term({}, static_cast<constant *>(node)->value());
+        break;
+      case expr_kind::variable:
+        p.add_term({{index.at(node), 1}}, 1);
+        break;
+      case expr_kind::add:
+      case expr_kind::sub: {
+        std::double_t sign = node->kind() == expr_kind::add ? 1 : -1;
+        p = take(node->operand(0));
+        for (std::size_t i = 1; i < node->arity(); ++i) {
+          polynomial rhs = take(node->operand(i));
+          for (auto const &[m, c] : rhs.terms)
+            p.add_term(m, sign * c);
+        }
+        break;
+      }
+      case expr_kind::mul:
+        p = take(node->operand(0));
+        for (std::size_t i = 1; i < node->arity(); ++i) {
+          std::optional<polynomial> q = p.times(take(node->operand(i)));
+          if (!q)
+            return false;
+          p = std::move(*q);
+        }
+        break;
+      case expr_kind::div: {
+        std::double_t d = static_cast<constant *>(node->operand(1))->value();
+        p = take(node->operand(0));
+        for (auto &[m, c] : p.terms)
+          c /= d;
+        break;
+      }
+      case expr_kind::pow: {
+        polynomial base = take(node->operand(0));
+        auto n = static_cast<std::uint64_t>(
+            static_cast<constant *>(node->operand(1))->value());
+        // The base is a single term, or none when it is zero.
+        if (base.terms.empty())
+          break;
+        monomial m = base.terms.begin()->first;
+        std::double_t c = base.terms.begin()->second;
+        for (auto &[i, e] : m) {
+          if (e * n > UINT32_MAX)
+            return false;
+          e = static_cast<std::uint32_t>(e * n);
+        }
+        if (n == 0)
+          m.clear();
+        p.add_term(m, std::pow(c, static_cast<std::double_t>(n)));
+        break;
+      }
+      default:
+        return false;
+      }
+      expanded.emplace(node, std::move(p));
+    }
+    out.emplace(std::move(expanded.at(root)));
+    return true;
+  }
+
+  std::size_t size() const { return terms.size(); }
+
+  // Whether no coefficient has overflowed. Callers fall back to the
+  // symbolic rules otherwise, which leave such constants unfolded.
+  bool finite() const {
+    return std::all_of(terms.begin(), terms.end(), [](auto const &t) {
+      return std::isfinite(t.second);
+    });
+  }
+
+  polynomial diff(base_expr_s dv) const {
+    polynomial out(vars);
+    auto it = std::find(vars->begin(), vars->end(), dv);
+    if (it == vars->end())
+      return out;
+    auto i = static_cast<std::uint32_t>(it - vars->begin());
+    for (auto const &[m, c] : terms) {
+      auto at = std::lower_bound(m.begin(), m.end(), std::make_pair(i, 0u));
+      if (at == m.end() || at->first != i)
+        continue;
+      monomial d(m);
+      std::uint32_t e = at->second;
+      auto slot = d.begin() + (at - m.begin());
+      if (e == 1)
+        d.erase(slot);
+      else
+        --slot->second;
+      out.add_term(d, c * e);
+    }
+    return out;
+  }
+
+  // One sum built from all the terms at once, see add.
+  base_expr_s to_expr() const {
+    std::vector<base_expr_s> sum;
+    for (auto const &[m, c] : terms) {
+      std::vector<base_expr_s> factors{constant::create(c)};
+      for (auto const &[i, e] : m)
+        factors.push_back(pow::create((*vars)[i], constant::create(e)));
+      sum.push_back(mul::create(factors));
+    }
+    return add::create(sum);
+  }
+};
+
+// The k-th derivative of expr with respect to dv, see derivatives(). A
+// polynomial is differentiated k times in polynomial form instead, which
+// keeps the result expanded.
+base_expr_s nth_diff(base_expr_s expr, base_expr_s dv, std::size_t k) {
+  std::unordered_set<base_expr const *> refused;
+  std::optional<polynomial> p;
+  if (expr->arity() > 0 && polynomial::fits(expr, refused) &&
+      polynomial::from_expr(expr, p)) {
+    for (std::size_t j = 0; j < k; ++j)
+      p = p->diff(dv);
+    if (p->finite())
+      return p->to_expr();
+  }
+  return derivatives(expr, dv, k)[k];
+}
+
+// Post-order over the nodes whose derivative is not cached yet. A node is
+// derived only once all its operands are, so derive() never recurses more
+// than one level. Polynomial subtrees are expanded whole on the way down and
+// are not descended into. While a thunk expands, other compound nodes give
+// thunks instead. Subtrees whose variable mask misses dv are never walked.
+base_expr_s base_expr::diff(base_expr_s dv) {
+  derivative_cache &cache = session::current().derivatives;
+  engine_stats &stats = engine_stats::local();
+  if (!(vars & dv->vars)) {
+    stats.mask_skips.add();
+    return constant::create(0);
+  }
+  if (base_expr_s d = cache.find(this, dv)) {
+    stats.derivative_hits.add();
+    return d;
+  }
+  if (deferring() && arity() > 0 && !is_polynomial())
+    return thunk::create(this, dv);
+  // Each entry is a node and whether its operands have been pushed.
+  std::vector<std::pair<base_expr_s, bool>> stack{{this, false}};
+  std::unordered_set<base_expr const *> refused;
+  while (!stack.empty()) {
+    auto [node, expanded] = stack.back();
+    if (expanded) {
+      stack.pop_back();
+      stats.derived.add();
+      cache.insert(node, dv, node->derive(dv));
+      continue;
+    }
+    if (cache.find(node, dv)) {
+      stack.pop_back();
+      stats.derivative_hits.add();
+      continue;
+    }
+    std::optional<polynomial> p;
+    if (node->arity() > 0 && polynomial::fits(node, refused) &&
+        polynomial::from_expr(node, p) && (p = p->diff(dv))->finite()) {
+      stack.pop_back();
+      stats.derived.add();
+      stats.derived_poly.add();
+      cache.insert(node, dv, p->to_expr());
+      continue;
+    }
+    stack.back().second = true;
+    for (std::size_t i = node->arity(); i-- > 0;) {
+      base_expr_s child = node->operand(i);
+      // derive() gets 0 for these from the mask test above.
+      if (!(child->vars & dv->vars))
+        continue;
+      if (cache.find(child, dv))
+        stats.derivative_hits.add();
+      else
+        stack.emplace_back(child, false);
+    }
+  }
+  return cache.find(this, dv);
+}
+
+// Leaves and polynomials are cheap to derive in full, so only other
+// compound nodes are deferred. Results are not entered in the derivative
+// cache, which holds built derivatives only; the thunk keeps them instead.
+base_expr_s base_expr::lazy_diff(base_expr_s dv) {
+  if (arity() == 0 || is_polynomial())
+    return diff(dv);
+  return resolve(thunk::create(this, dv));
+}
+
+// Branch-free ln/exp/pow used by the batch evaluator. Written as scalar
+// code over plain bit manipulation and selects so that a lane loop around
+// them auto-vectorizes (AVX2, AVX-512 or NEON, whatever the build targets).
+namespace lane {
+
+constexpr std::size_t width = 8;
+
+inline std::uint64_t bits(std::double_t x) {
+  std::uint64_t u;
+  std::memcpy(&u, &x, sizeof u);
+  return u;
+}
+
+inline std::double_t from_bits(std::uint64_t u) {
+  std::double_t x;
+  std::memcpy(&x, &u, sizeof x);
+  return x;
+}
+
+// Round to nearest integer for |x| < 2^51 by pushing the fraction out of
+// the mantissa; unlike nearbyint this vectorizes on every target.
+constexpr std::double_t round_magic = 6755399441055744.0; // 1.5 * 2^52
+
+inline std::double_t round(std::double_t x) {
+  return (x + round_magic) - round_magic;
+}
+
+// 2^n for an integral n in [-1022, 1023].
+inline std::double_t exp2i(std::double_t n) {
+  std::uint64_t i = bits(n + round_magic) - bits(round_magic);
+  return from_bits((i + 1023) << 52);
+}
+
+inline std::double_t log(std::double_t x) {
+  constexpr std::double_t ln2 = 0.6931471805599453;
+  constexpr std::double_t two52 = 4503599627370496.0;
+  // Lift subnormals into the normal range first.
+  bool tiny = x < 2.2250738585072014e-308;
+  std::double_t y = tiny ? x * 18014398509481984.0 : x; // 2^54
+  std::uint64_t u = bits(y);
+  std::double_t e = from_bits(((u >> 52) & 0x7ff) | bits(two52)) - two52;
+  e = e - (tiny ? 1023 + 54 : 1023);
+  std::double_t m =
+      from_bits((u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+  bool big = m > 1.4142135623730951;
+  m = big ? m * 0.5 : m;
+  e = big ? e + 1 : e;
+  // ln(m) = 2 atanh(s) with s = (m - 1) / (m + 1), |s| < 0.172.
+  std::double_t s = (m - 1) / (m + 1);
+  std::double_t s2 = s * s;
+  std::double_t p = 1.0 / 21;
+  p = p * s2 + 1.0 / 19;
+  p = p * s2 + 1.0 / 17;
+  p = p * s2 + 1.0 / 15;
+  p = p * s2 + 1.0 / 13;
+  p = p * s2 + 1.0 / 11;
+  p = p * s2 + 1.0 / 9;
+  p = p * s2 + 1.0 / 7;
+  p = p * s2 + 1.0 / 5;
+  p = p * s2 + 1.0 / 3;
+  p = p * s2 + 1;
+  std::double_t r = 2 * s * p + e * ln2;
+  r = x == 0 ? -HUGE_VAL : r;
+  r = x < 0 || x != x ? NAN : r;
+  return x == HUGE_VAL ? x : r;
+}
+
+inline std::double_t exp(std::double_t x) {
+  constexpr std::double_t log2e = 1.4426950408889634;
+  constexpr std::double_t ln2_hi = 0.6931471803691238;
+  constexpr std::double_t ln2_lo = 1.9082149292705877e-10;
+  std::double_t c = x > 710 ? 710 : (x < -746 ? -746 : x);
+  c = x != x ? 0 : c;
+  std::double_t n = round(c * log2e);
+  std::double_t r = c - n * ln2_hi - n * ln2_lo;
+  std::double_t p = 1.0 / 6227020800;
+  p = p * r + 1.0 / 479001600;
+  p = p * r + 1.0 / 39916800;
+  p = p * r + 1.0 / 3628800;
+  p = p * r + 1.0 / 362880;
+  p = p * r + 1.0 / 40320;
+  p = p * r + 1.0 / 5040;
+  p = p * r + 1.0 / 720;
+  p = p * r + 1.0 / 120;
+  p = p * r + 1.0 / 24;
+  p = p * r + 1.0 / 6;
+  p = p * r + 0.5;
+  p = p * r + 1;
+  p = p * r + 1;
+  // Scale in two halves so results near overflow and in the subnormal
+  // range stay exact.
+  std::double_t n1 = round(n * 0.5);
+  std::double_t y = p * exp2i(n1) * exp2i(n - n1);
+  return x != x ? x : y;
+}
+
+inline std::double_t pow(std::double_t a, std::double_t b) {
+  constexpr std::double_t two52 = 4503599627370496.0;
+  std::double_t mag = lane::exp(b * lane::log(std::fabs(a)));
+  bool huge = std::fabs(b) >= two52;
+  bool integral = huge || round(b) == b;
+  bool odd = integral && !huge && round(b * 0.5) != b * 0.5;
+  std::double_t r = a < 0 ? (integral ? (odd ? -mag : mag) : NAN) : mag;
+  return b == 0 ? 1 : r;
+}
+
+} // namespace lane
+
+// Numbers that carry derivatives along with their value, so evaluating a
+// tape over them yields f' at a point without building d/dx as nodes.
+namespace forward {
+
+// v + d e with e^2 = 0: a value and its first derivative.
+struct dual {
+  std::double_t v = 0;
+  std::double_t d = 0;
+
+  dual() = default;
+  dual(std::double_t v, std::double_t d = 0) : v(v), d(d) {};
+};
+
+inline dual operator+(dual a, dual b) { return {a.v + b.v, a.d + b.d}; }
+inline dual operator-(dual a, dual b) { return {a.v - b.v, a.d - b.d}; }
+inline dual operator*(dual a, dual b) {
+  return {a.v * b.v, a.d * b.v + a.v * b.d};
+}
+inline dual operator/(dual a, dual b) {
+  return {a.v / b.v, (a.d * b.v - a.v * b.d) / (b.v * b.v)};
+}
+inline dual log(dual a) { return {std::log(a.v), a.d / a.v}; }
+
+inline dual pow(dual a, dual b) {
+  std::double_t v = std::pow(a.v, b.v);
+  // A constant exponent needs no ln(a), so a negative base works.
+  if (b.d == 0)
+    return {v, b.v == 0 ? 0 : b.v * std::pow(a.v, b.v - 1) * a.d};
+  std::double_t d = b.d * std::log(a.v);
+  if (a.d != 0)
+    d += b.v * a.d / a.v;
+  return {v, v * d};
+}
+
+// v + d1 e1 + d2 e2 + d12 e1 e2 with e1^2 = e2^2 = 0. Seeding e1 along x_i
+// and e2 along x_j makes d12 the exact second partial in x_i and x_j.
+struct hyper_dual {
+  std::double_t v = 0;
+  std::double_t d1 = 0;
+  std::double_t d2 = 0;
+  std::double_t d12 = 0;
+
+  hyper_dual() = default;
+  hyper_dual(std::double_t v, std::double_t d1 = 0, std::double_t d2 = 0,
+             std::double_t d12 = 0)
+      : v(v), d1(d1), d2(d2), d12(d12) {};
+
+  bool is_constant() const { return d1 == 0 && d2 == 0 && d12 == 0; }
+};
+
+// f(a), given f, f' and f'' at a.v.
+inline hyper_dual apply(hyper_dual a, std::double_t f, std::double_t f1,
+                        std::double_t f2) {
+  return {f, f1 * a.d1, f1 * a.d2, f1 * a.d12 + f2 * a.d1 * a.d2};
+}
+
+inline hyper_dual operator+(hyper_dual a, hyper_dual b) {
+  return {a.v + b.v, a.d1 + b.d1, a.d2 + b.d2, a.d12 + b.d12};
+}
+inline hyper_dual operator-(hyper_dual a, hyper_dual b) {
+  return {a.v - b.v, a.d1 - b.d1, a.d2 - b.d2, a.d12 - b.d12};
+}
+inline hyper_dual operator*(hyper_dual a, hyper_dual b) {
+  return {a.v * b.v, a.d1 * b.v + a.v * b.d1, a.d2 * b.v + a.v * b.d2,
+          a.d12 * b.v + a.d1 * b.d2 + a.d2 * b.d1 + a.v * b.d12};
+}
+inline hyper_dual operator/(hyper_dual a, hyper_dual b) {
+  std::double_t r = 1 / b.v;
+  return a * apply(b, r, -r * r, 2 * r * r * r);
+}
+inline hyper_dual log(hyper_dual a) {
+  std::double_t r = 1 / a.v;
+  return apply(a, std::log(a.v), r, -r * r);
+}
+inline hyper_dual exp(hyper_dual a) {
+  std::double_t e = std::exp(a.v);
+  return apply(a, e, e, e);
+}
+
+inline hyper_dual pow(hyper_dual a, hyper_dual b) {
+  if (!b.is_constant())
+    return exp(b * log(a));
+  std::double_t c = b.v;
+  std::double_t f1 = c == 0 ? 0 : c * std::pow(a.v, c - 1);
+  std::double_t f2 = c == 0 || c == 1 ? 0 : c * (c - 1) * std::pow(a.v, c - 2);
+  return apply(a, std::pow(a.v, c), f1, f2);
+}
+
+} // namespace forward
+
+// A compiled expression: a linear instruction list where instruction i
+// writes register i and reads only earlier registers, or a variable slot, or
+// its inline constant. Several outputs (say f and its derivative) compiled
+// into one tape share every common subexpression.
+class tape {
+public:
+  struct instr {
+    expr_kind op;
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+    std::double_t imm = 0;
+  };
+
+private:
+  std::vector<instr> code;
+  std::vector<std::uint32_t> outputs;
+  std::size_t slots = 0;
+  mutable std::vector<std::double_t> scratch;
+  std::vector<base_expr_s> bound;
+  // The instruction computing each node, and the length of the code when
+  // it was last built from scratch.
+  std::unordered_map<base_expr const *, std::uint32_t> reg;
+  std::size_t built = 0;
+
+  // The code for node, with operands read from registers[operand], passed
+  // to put one instruction at a time; put returns the register written.
+  template <typename Put>
+  std::uint32_t
+  lower(base_expr_s node,
+        std::unordered_map<base_expr const *, std::uint32_t> const &registers,
+        Put const &put) const {
+    instr in{node->kind()};
+    switch (node->kind()) {
+    case expr_kind::constant:
+      in.imm = static_cast<constant *>(node)->value();
+      break;
+    case expr_kind::variable: {
+      auto it = std::find(bound.begin(), bound.end(), node);
+      if (it == bound.end())
+        throw std::runtime_error("unbound variable: " +
+                                 static_cast<variable *>(node)->label());
+      in.a = static_cast<std::uint32_t>(it - bound.begin());
+      break;
+    }
+    case expr_kind::ln:
+      in.a = registers.at(node->operand(0));
+      break;
+    default:
+      // An n-ary sum or product becomes a chain of binary steps.
+      in.a = registers.at(node->operand(0));
+      for (std::size_t i = 1; i + 1 < node->arity(); ++i) {
+        in.b = registers.at(node->operand(i));
+        in.a = put(in);
+      }
+      in.b = registers.at(node->operand(node->arity() - 1));
+      break;
+    }
+    return put(in);
+  }
+
+  // Visits, children first, every node under roots not in registers yet,
+  // in the order topo_order() would give, and records the register
+  // lower(node) returns.
+  template <typename Put>
+  void walk(std::vector<base_expr_s> const &roots,
+            std::unordered_map<base_expr const *, std::uint32_t> &registers,
+            Put const &put) const {
+    std::vector<std::pair<base_expr_s, std::size_t>> stack;
+    for (base_expr_s root : roots) {
+      if (registers.count(root))
+        continue;
+      stack.emplace_back(root, 0);
+      while (!stack.empty()) {
+        auto &[node, next] = stack.back();
+        if (next < node->arity()) {
+          base_expr_s child = node->operand(next++);
+          if (!registers.count(child))
+            stack.emplace_back(child, 0);
+          continue;
+        }
+        registers.emplace(node, lower(node, registers, put));
+        stack.pop_back();
+      }
+    }
+  }
+
+  // Code for every node under roots the tape does not compute yet.
+  void append(std::vector<base_expr_s> const &roots) {
+    walk(roots, reg, [this](instr const &in) {
+      code.push_back(in);
+      return static_cast<std::uint32_t>(code.size() - 1);
+    });
+    outputs.clear();
+    for (base_expr_s root : roots)
+      outputs.push_back(reg.at(root));
+  }
+
+  // The values of vars as T, so callers can seed derivative parts.
+  template <typename T>
+  std::vector<T> lift(std::vector<std::double_t> const &values,
+                      std::initializer_list<std::size_t> seeded) const {
+    if (values.size() != slots)
+      throw std::invalid_argument("wrong number of variable values");
+    for (std::size_t var : seeded)
+      if (var >= slots)
+        throw std::out_of_range("no such variable slot");
+    return std::vector<T>(values.begin(), values.end());
+  }
+
+  // The first output over in, with a register file per thread and type.
+  template <typename T> T eval_as(std::vector<T> const &in) const {
+    static thread_local std::vector<T> regs;
+    regs.resize(code.size());
+    run(in.data(), regs.data());
+    return regs[outputs[0]];
+  }
+
+public:
+  // vars[i] is bound to slot i of the values passed to eval().
+  tape(std::vector<base_expr_s> const &roots,
+       std::vector<base_expr_s> const &vars)
+      : slots(vars.size()), bound(vars) {
+    append(roots);
+    built = code.size();
+  }
+
+  tape(base_expr_s root, std::vector<base_expr_s> const &vars)
+      : tape(std::vector<base_expr_s>{root}, vars) {};
+
+  // Retargets the tape at new roots over the same variables, such as an
+  // expr_editor's derivative after an edit. Only nodes the tape has not
+  // seen get code; the rest is reused. Code of nodes no longer reached
+  // still runs, so once the tape has doubled since it was last built it
+  // is rebuilt from scratch.
+  void update(std::vector<base_expr_s> const &roots) {
+    append(roots);
+    if (code.size() > 2 * built) {
+      code.clear();
+      reg.clear();
+      append(roots);
+      built = code.size();
+    }
+  }
+
+  // Whether a tape built from scratch for roots over vars would have
+  // exactly this code, found by comparing instruction by instruction
+  // without storing any.
+  bool matches(std::vector<base_expr_s> const &roots,
+               std::vector<base_expr_s> const &vars) const {
+    if (vars.size() != slots || roots.size() != outputs.size())
+      return false;
+    auto same = [](instr const &x, instr const &y) {
+      return x.op == y.op && x.a == y.a && x.b == y.b &&
+             std::memcmp(&x.imm, &y.imm, sizeof x.imm) == 0;
+    };
+    std::unordered_map<base_expr const *, std::uint32_t> registers;
+    std::size_t pos = 0;
+    bool equal = true;
+    tape probe(std::vector<base_expr_s>{}, vars);
+    probe.walk(roots, registers, [&](instr const &in) {
+      equal = equal && pos < code.size() && same(code[pos], in);
+      return static_cast<std::uint32_t>(pos++);
+    });
+    if (!equal || pos != code.size())
+      return false;
+    for (std::size_t k = 0; k < roots.size(); ++k)
+      if (registers.at(roots[k]) != outputs[k])
+        return false;
+    return true;
+  }
+
+  // Drops the nodes the tape was built from and keeps only the code, for a
+  // tape that outlives their session. update() cannot be used after.
+  void detach() {
+    bound.clear();
+    reg = {};
+  }
+
+  std::vector<instr> const &instructions() const { return code; }
+  std::vector<std::uint32_t> const &results() const { return outputs; }
+  std::size_t inputs() const { return slots; }
+
+  // regs must hold instructions().size() values; output i ends up in
+  // regs[results()[i]]. T is double, or one of the forward:: numbers.
+  template <typename T> void run(T const *vars, T *regs) const {
+    using std::log;
+    using std::pow;
+    std::size_t n = code.size();
+    instr const *in = code.data();
+    for (std::size_t i = 0; i < n; ++i, ++in) {
+      switch (in->op) {
+      case expr_kind::constant:
+        regs[i] = in->imm;
+        break;
+      case expr_kind::variable:
+        regs[i] = vars[in->a];
+        break;
+      case expr_kind::add:
+        regs[i] = regs[in->a] + regs[in->b];
+        break;
+      case expr_kind::sub:
+        regs[i] = regs[in->a] - regs[in->b];
+        break;
+      case expr_kind::mul:
+        regs[i] = regs[in->a] * regs[in->b];
+        break;
+      case expr_kind::div:
+        regs[i] = regs[in->a] / regs[in->b];
+        break;
+      case expr_kind::pow:
+        regs[i] = pow(regs[in->a], regs[in->b]);
+        break;
+      case expr_kind::ln:
+        regs[i] = log(regs[in->a]);
+        break;
+      case expr_kind::thunk:
+        // operand() expands thunks, so tapes never hold one.
+        break;
+      }
+    }
+  }
+
+  // Value of the first output. Reuses an internal register file, so a tape
+  // must not be evaluated from several threads at once through this call.
+  std::double_t eval(std::vector<std::double_t> const &values) const {
+    if (values.size() != slots)
+      throw std::invalid_argument("wrong number of variable values");
+    scratch.resize(code.size());
+    run(values.data(), scratch.data());
+    return scratch[outputs[0]];
+  }
+
+  // The first output and its derivative in x_var, from one pass over the
+  // tape in dual numbers. Nothing is built, so this is the cheap way to
+  // get f' at a few points.
+  forward::dual eval_dual(std::vector<std::double_t> const &values,
+                          std::size_t var) const {
+    std::vector<forward::dual> in = lift<forward::dual>(values, {var});
+    in[var].d = 1;
+    return eval_as(in);
+  }
+
+  // The same in hyper-dual numbers: d1 and d2 are the first partials in
+  // x_i and x_j, d12 the second partial in both. i == j gives f''.
+  forward::hyper_dual eval_hyper_dual(std::vector<std::double_t> const &values,
+                                      std::size_t i, std::size_t j) const {
+    std::vector<forward::hyper_dual> in =
+        lift<forward::hyper_dual>(values, {i, j});
+    in[i].d1 = 1;
+    in[j].d2 = 1;
+    return eval_as(in);
+  }
+
+  // eval_dual() at n points laid out as for eval_batch(), writing the
+  // values of the first output to value and its derivatives to deriv.
+  void eval_dual_batch(std::double_t const *const *vars, std::size_t n,
+                       std::size_t var, std::double_t *value,
+                       std::double_t *deriv) const {
+    if (var >= slots)
+      throw std::out_of_range("no such variable slot");
+    std::vector<forward::dual> in(slots);
+    std::vector<forward::dual> regs(code.size());
+    for (std::size_t p = 0; p < n; ++p) {
+      for (std::size_t j = 0; j < slots; ++j)
+        in[j] = {vars[j][p], j == var ? 1.0 : 0.0};
+      run(in.data(), regs.data());
+      value[p] = regs[outputs[0]].v;
+      deriv[p] = regs[outputs[0]].d;
+    }
+  }
+
+  // Evaluates every output at n points. vars[j] holds the n values of
+  // variable j (structure of arrays) and out[k] receives the n values of
+  // output k. Points go through lane::width at a time, so each instruction
+  // becomes one short loop over lanes that the compiler vectorizes.
+  void eval_batch(std::double_t const *const *vars, std::size_t n,
+                  std::double_t *const *out) const {
+    constexpr std::size_t w = lane::width;
+    std::vector<std::double_t> regs(code.size() * w);
+    for (std::size_t base = 0; base < n; base += w) {
+      std::size_t m = std::min(w, n - base);
+      for (std::size_t i = 0; i < code.size(); ++i) {
+        instr const &in = code[i];
+        std::double_t *r = &regs[i * w];
+        auto unary = [&](auto f) {
+          std::double_t const *x = &regs[in.a * w];
+          for (std::size_t l = 0; l < w; ++l)
+            r[l] = f(x[l]);
+        };
+        auto binary = [&](auto f) {
+          std::double_t const *x = &regs[in.a * w];
+          std::double_t const *y = &regs[in.b * w];
+          for (std::size_t l = 0; l < w; ++l)
+            r[l] = f(x[l], y[l]);
+        };
+        switch (in.op) {
+        case expr_kind::constant:
+          std::fill(r, r + w, in.imm);
+          break;
+        case expr_kind::variable:
+          // Pad a short final block with a harmless value.
+          std::fill(std::copy(vars[in.a] + base, vars[in.a] + base + m, r),
+                    r + w, 1.0);
+          break;
+        case expr_kind::add:
+          binary([](std::double_t x, std::double_t y) { return x + y; });
+          break;
+        case expr_kind::sub:
+          binary([](std::double_t x, std::double_t y) { return x - y; });
+          break;
+        case expr_kind::mul:
+          binary([](std::double_t x, std::double_t y) { return x * y; });
+          break;
+        case expr_kind::div:
+          binary([](std::double_t x, std::double_t y) { return x / y; });
+          break;
+        case expr_kind::pow:
+          binary(lane::pow);
+          break;
+        case expr_kind::ln:
+          unary(lane::log);
+          break;
+        case expr_kind::thunk:
+          break;
+        }
+      }
+      for (std::size_t k = 0; k < outputs.size(); ++k)
+        std::copy(&regs[outputs[k] * w], &regs[outputs[k] * w] + m,
+                  out[k] + base);
+    }
+  }
+
+  // Every output, in the order the roots were given.
+  std::vector<std::double_t>
+  eval_all(std::vector<std::double_t> const &values) const {
+    eval(values);
+    std::vector<std::double_t> out;
+    for (std::uint32_t r : outputs)
+      out.push_back(scratch[r]);
+    return out;
+  }
+};
+
+// Native code for a single-output tape. On x86-64 Unix the tape is
+// compiled by a small emitter into scalar SSE2 code, with ln and ^ as calls
+// into libm; elsewhere, or for tapes too large for a stack frame, calls go
+// to the tape interpreter instead. compile() caches by structural hash, so
+// requesting the same function again skips code generation; the cache
+// holds the most recently used functions only, see cache_limit().
+class jit_function {
+public:
+  using scalar_fn = std::double_t (*)(std::double_t const *vars);
+  // vars[j] holds the n values of variable j; out receives n results.
+  using batch_fn = void (*)(std::double_t const *const *vars, std::size_t n,
+                            std::double_t *out);
+
+private:
+  tape program;
+  void *code = nullptr;
+  std::size_t code_size = 0;
+  scalar_fn scalar_entry = nullptr;
+  batch_fn batch_entry = nullptr;
+
+  // Keeps every value in a stack slot; the widest supported frame.
+  static constexpr std::size_t max_instructions = 1 << 16;
+
+  static std::double_t call_log(std::double_t x) { return std::log(x); }
+  static std::double_t call_pow(std::double_t x, std::double_t y) {
+    return std::pow(x, y);
+  }
+
+  struct emitter {
+    std::vector<std::uint8_t> bytes;
+
+    void put(std::initializer_list<std::uint8_t> b) {
+      bytes.insert(bytes.end(), b);
+    }
+    void put32(std::uint32_t v) {
+      for (int i = 0; i < 4; ++i)
+        bytes.push_back(static_cast<std::uint8_t>(v >> (8 * i)));
+    }
+    void put64(std::uint64_t v) {
+      put32(static_cast<std::uint32_t>(v));
+      put32(static_cast<std::uint32_t>(v >> 32));
+    }
+
+    // F2 0F op xmm(reg), [rsp + disp32]: movsd load (10), store (11),
+    // addsd (58), mulsd (59), subsd (5C), divsd (5E).
+    void sse_slot(std::uint8_t op, int xmm, std::uint32_t slot) {
+      put({0xF2, 0x0F, op, static_cast<std::uint8_t>(0x84 | xmm << 3), 0x24});
+      put32(slot * 8);
+    }
+    void load_imm(std::double_t v) {
+      std::uint64_t u;
+      std::memcpy(&u, &v, sizeof u);
+      put({0x48, 0xB8}); // mov rax, imm64
+      put64(u);
+      put({0x66, 0x48, 0x0F, 0x6E, 0xC0}); // movq xmm0, rax
+    }
+    void call(void const *fn) {
+      put({0x48, 0xB8}); // mov rax, imm64
+      put64(reinterpret_cast<std::uintptr_t>(fn));
+      put({0xFF, 0xD0}); // call rax
+    }
+  };
+
+  // The instructions of program, leaving value i in stack slot i. xmm0
+  // tracks the last value computed so a following use skips the reload.
+  // load_var emits the load of variable a into xmm0.
+  template <typename LoadVar>
+  void emit_body(emitter &e, LoadVar load_var) const {
+    std::vector<tape::instr> const &code = program.instructions();
+    std::size_t cached = SIZE_MAX;
+    for (std::size_t i = 0; i < code.size(); ++i) {
+      tape::instr const &in = code[i];
+      auto load = [&](std::uint32_t slot) {
+        if (cached != slot)
+          e.sse_slot(0x10, 0, slot);
+      };
+      switch (in.op) {
+      case expr_kind::constant:
+        e.load_imm(in.imm);
+        break;
+      case expr_kind::variable:
+        load_var(in.a);
+        break;
+      case expr_kind::add:
+      case expr_kind::mul: {
+        std::uint8_t op = in.op == expr_kind::add ? 0x58 : 0x59;
+        if (cached == in.b) {
+          e.sse_slot(op, 0, in.a);
+        } else {
+          load(in.a);
+          e.sse_slot(op, 0, in.b);
+        }
+        break;
+      }
+      case expr_kind::sub:
+      case expr_kind::div:
+        load(in.a);
+        e.sse_slot(in.op == expr_kind::sub ? 0x5C : 0x5E, 0, in.b);
+        break;
+      case expr_kind::ln:
+        load(in.a);
+        e.call(reinterpret_cast<void const *>(&call_log));
+        break;
+      case expr_kind::pow:
+        e.sse_slot(0x10, 1, in.b);
+        load(in.a);
+        e.call(reinterpret_cast<void const *>(&call_pow));
+        break;
+      case expr_kind::thunk:
+        break;
+      }
+      e.sse_slot(0x11, 0, static_cast<std::uint32_t>(i));
+      cached = i;
+    }
+  }
+
+  // Stack bytes for the value slots, such that rsp is 16-byte aligned at
+  // calls once `pushes` registers are saved above the return address.
+  std::uint32_t frame_size(int pushes) const {
+    std::size_t bytes = program.instructions().size() * 8;
+    if ((8 + 8 * pushes + bytes) % 16)
+      bytes += 8;
+    return static_cast<std::uint32_t>(bytes);
+  }
+
+  // double f(const double *vars), with vars kept in rbx.
+  std::vector<std::uint8_t> emit_scalar() const {
+    emitter e;
+    std::uint32_t frame = frame_size(1);
+    e.put({0x53});             // push rbx
+    e.put({0x48, 0x89, 0xFB}); // mov rbx, rdi
+    e.put({0x48, 0x81, 0xEC}); // sub rsp, frame
+    e.put32(frame);
+    emit_body(e, [&](std::uint32_t a) {
+      e.put({0xF2, 0x0F, 0x10, 0x83}); // movsd xmm0, [rbx + disp32]
+      e.put32(a * 8);
+    });
+    e.sse_slot(0x10, 0, program.results()[0]);
+    e.put({0x48, 0x81, 0xC4}); // add rsp, frame
+    e.put32(frame);
+    e.put({0x5B, 0xC3}); // pop rbx; ret
+    return e.bytes;
+  }
+
+  // void f(const double *const *vars, size_t n, double *out): rbx = vars,
+  // r12 = n, r13 = out, r14 = point index.
+  std::vector<std::uint8_t> emit_batch() const {
+    emitter e;
+    std::uint32_t frame = frame_size(4);
+    e.put({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56}); // push rbx, r12-r14
+    e.put({0x48, 0x89, 0xFB});                         // mov rbx, rdi
+    e.put({0x49, 0x89, 0xF4});                         // mov r12, rsi
+    e.put({0x49, 0x89, 0xD5});                         // mov r13, rdx
+    e.put({0x45, 0x31, 0xF6});                         // xor r14d, r14d
+    e.put({0x48, 0x81, 0xEC});                         // sub rsp, frame
+    e.put32(frame);
+    e.put({0x4D, 0x85, 0xE4}); // test r12, r12
+    e.put({0x0F, 0x84});       // jz done
+    std::size_t skip = e.bytes.size();
+    e.put32(0);
+    std::size_t loop = e.bytes.size();
+    emit_body(e, [&](std::uint32_t a) {
+      e.put({0x48, 0x8B, 0x83}); // mov rax, [rbx + disp32]
+      e.put32(a * 8);
+      e.put({0xF2, 0x42, 0x0F, 0x10, 0x04, 0xF0}); // movsd xmm0, [rax+r14*8]
+    });
+    e.sse_slot(0x10, 0, program.results()[0]);
+    e.put({0xF2, 0x43, 0x0F, 0x11, 0x44, 0xF5, 0x00}); // movsd [r13+r14*8]
+    e.put({0x49, 0xFF, 0xC6});                         // inc r14
+    e.put({0x4D, 0x39, 0xE6});                         // cmp r14, r12
+    e.put({0x0F, 0x82});                               // jb loop
+    e.put32(static_cast<std::uint32_t>(loop - (e.bytes.size() + 4)));
+    std::uint32_t done = static_cast<std::uint32_t>(e.bytes.size() - skip - 4);
+    std::memcpy(&e.bytes[skip], &done, 4);
+    e.put({0x48, 0x81, 0xC4}); // add rsp, frame
+    e.put32(frame);
+    e.put({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop...; ret
+    return e.bytes;
+  }
+
+  void install() {
+#if defined(__x86_64__) && defined(__unix__)
+    if (program.instructions().size() > max_instructions)
+      return;
+    std::vector<std::uint8_t> scalar = emit_scalar();
+    std::vector<std::uint8_t> batch = emit_batch();
+    std::size_t size = scalar.size() + batch.size();
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return;
+    auto *bytes = static_cast<std::uint8_t *>(p);
+    std::memcpy(bytes, scalar.data(), scalar.size());
+    std::memcpy(bytes + scalar.size(), batch.data(), batch.size());
+    if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(p, size);
+      return;
+    }
+    code = p;
+    code_size = size;
+    scalar_entry = reinterpret_cast<scalar_fn>(bytes);
+    batch_entry = reinterpret_cast<batch_fn>(bytes + scalar.size());
+#endif
+  }
+
+  // Compiled functions by structural key, most recently used first. Past
+  // capacity the least recently used one is dropped, and with it its code
+  // once no caller holds it any more.
+  struct function_cache {
+    using entry = std::pair<std::uint64_t, std::shared_ptr<jit_function const>>;
+
+    std::mutex lock;
+    std::list<entry> recent;
+    std::unordered_multimap<std::uint64_t, std::list<entry>::iterator> index;
+    std::size_t capacity = 1024;
+  };
+
+  static function_cache &cache() {
+    static function_cache c;
+    return c;
+  }
+
+  jit_function(tape &&t) : program(std::move(t)) {
+    program.detach();
+    install();
+  }
+
+public:
+  jit_function(jit_function const &) = delete;
+  jit_function &operator=(jit_function const &) = delete;
+
+  ~jit_function() {
+#if defined(__x86_64__) && defined(__unix__)
+    if (code)
+      munmap(code, code_size);
+#endif
+  }
+
+  // root as a function of vars. Functions are shared process-wide, keyed
+  // by the structural hash of root and vars and confirmed against the
+  // cached code, so they outlive the session root was built in. The
+  // tape is only built when the key misses.
+  static std::shared_ptr<jit_function const>
+  compile(base_expr_s root, std::vector<base_expr_s> const &vars) {
+    std::uint64_t key = root->hash();
+    for (base_expr_s v : vars)
+      key = hash_mix(key, v->hash());
+    function_cache &c = cache();
+    auto lookup = [&]() -> std::shared_ptr<jit_function const> {
+      auto [first, last] = c.index.equal_range(key);
+      for (auto it = first; it != last; ++it) {
+        if (it->second->second->program.matches({root}, vars)) {
+          c.recent.splice(c.recent.begin(), c.recent, it->second);
+          return it->second->second;
+        }
+      }
+      return nullptr;
+    };
+    {
+      std::lock_guard<std::mutex> guard(c.lock);
+      if (auto f = lookup())
+        return f;
+    }
+
+    std::shared_ptr<jit_function const> f(new jit_function(tape(root, vars)));
+    std::lock_guard<std::mutex> guard(c.lock);
+    // Another thread may have compiled the same function meanwhile.
+    if (auto other = lookup())
+      return other;
+    c.recent.emplace_front(key, f);
+    c.index.emplace(key, c.recent.begin());
+    while (c.recent.size() > c.capacity) {
+      auto [first, last] = c.index.equal_range(c.recent.back().first);
+      for (auto it = first; it != last; ++it) {
+        if (it->second == std::prev(c.recent.end())) {
+          c.index.erase(it);
+          break;
+        }
+      }
+      c.recent.pop_back();
+    }
+    return f;
+  }
+
+  // Caps the number of functions compile() keeps, dropping the least
+  // recently used ones past it.
+  static void cache_limit(std::size_t functions) {
+    function_cache &c = cache();
+    std::lock_guard<std::mutex> guard(c.lock);
+    c.capacity = functions;
+  }
+
+  // Whether calls run native code rather than the interpreter.
+  bool native() const { return scalar_entry != nullptr; }
+  // The native entry points, or nullptr when not native().
+  scalar_fn scalar() const { return scalar_entry; }
+  batch_fn batch() const { return batch_entry; }
+
+  std::double_t operator()(std::double_t const *vars) const {
+    if (scalar_entry)
+      return scalar_entry(vars);
+    static thread_local std::vector<std::double_t> regs;
+    regs.resize(program.instructions().size());
+    program.run(vars, regs.data());
+    return regs[program.results()[0]];
+  }
+
+  void operator()(std::double_t const *const *vars, std::size_t n,
+                  std::double_t *out) const {
+    if (batch_entry)
+      return batch_entry(vars, n, out);
+    program.eval_batch(vars, n, &out);
+  }
+};
+
+// Settings for emit_code.
+struct codegen_options {
+  std::string name = "f";
+  // C++ instead of C: <cmath> functions under std::.
+  bool cpp = false;
+  // Declare the scalar function constexpr (C++ only). Needs a compiler that
+  // folds std::log and std::pow, such as GCC, or C++26.
+  bool constexpr_fn = false;
+  // Also emit name_batch, one loop over structure-of-arrays inputs with
+  // non-aliasing pointers that compilers can vectorize.
+  bool batch = false;
+};
+
+// Writes standalone C or C++ source computing roots from vars: name(in,
+// out) sets out[k] to roots[k] with in[j] bound to vars[j]. Every
+// non-leaf node shared between several parents or roots is computed once
+// into a local; the rest are inlined with only the parentheses C needs.
+void emit_code(std::ostream &os, std::vector<base_expr_s> const &roots,
+               std::vector<base_expr_s> const &vars,
+               codegen_options const &opts) {
+  std::vector<base_expr_s> order = topo_order(roots);
+  std::unordered_map<base_expr const *, std::size_t> uses;
+  for (base_expr_s node : order)
+    for (std::size_t i = 0; i < node->arity(); ++i)
+      ++uses[node->operand(i)];
+  for (base_expr_s root : roots)
+    ++uses[root];
+
+  char const *math = opts.cpp ? "std::" : "";
+  std::string literal;
+  auto number = [&](std::double_t v) -> std::string const & {
+    if (std::isnan(v))
+      return literal = opts.cpp ? "std::nan(\"\")" : "NAN";
+    if (std::isinf(v))
+      return literal = v < 0 ? "-HUGE_VAL" : "HUGE_VAL";
+    char buf[32];
+    auto r = std::to_chars(buf, buf + sizeof buf, v);
+    literal.assign(buf, r.ptr);
+    if (literal.find_first_of(".e") == std::string::npos)
+      literal += ".0";
+    return literal;
+  };
+
+  // The body for a given way of reading input j, given as a prefix and
+  // suffix around j. Each node's code is kept with its binding level (as
+  // infix_level, calls being atoms) until its only parent consumes it.
+  auto body = [&](std::string const &indent, std::string const &in_prefix,
+                  std::string const &in_suffix, std::string const &out_suffix,
+                  std::ostream &os) {
+    std::unordered_map<base_expr const *, std::pair<std::string, int>> code;
+    std::size_t locals = 0;
+    auto take = [&](base_expr_s child, int need) {
+      auto it = code.find(child);
+      std::string text = uses[child] > 1 ? it->second.first
+                                         : std::move(it->second.first);
+      if (it->second.second < need)
+        text = "(" + text + ")";
+      return text;
+    };
+    for (base_expr_s node : order) {
+      std::string text;
+      int level = infix_level(node);
+      switch (node->kind()) {
+      case expr_kind::constant:
+        text = number(static_cast<constant *>(node)->value());
+        break;
+      case expr_kind::variable: {
+        std::size_t j = std::find(vars.begin(), vars.end(), node) -
+                        vars.begin();
+        if (j == vars.size())
+          throw std::runtime_error("unbound variable: " +
+                                   static_cast<variable *>(node)->label());
+        text = in_prefix + std::to_string(j) + in_suffix;
+        break;
+      }
+      case expr_kind::ln:
+        text = std::string(math) + "log(" + take(node->operand(0), 0) + ")";
+        level = 5;
+        break;
+      case expr_kind::pow:
+        text = std::string(math) + "pow(" + take(node->operand(0), 0) +
+               ", " + take(node->operand(1), 0) + ")";
+        level = 5;
+        break;
+      default:
+        for (std::size_t i = 0; i < node->arity(); ++i) {
+          if (i > 0) {
+            text += ' ';
+            text += operator_name(node->kind());
+            text += ' ';
+          }
+          text += take(node->operand(i), operand_level(node, i));
+        }
+        break;
+      }
+      if (uses[node] > 1 && node->arity() > 0) {
+        std::string local = "t" + std::to_string(locals++);
+        os << indent << (opts.cpp ? "double const " : "const double ")
+           << local << " = " << text << ";\n";
+        text = std::move(local);
+        level = 5;
+      }
+      code.emplace(node, std::make_pair(std::move(text), level));
+    }
+    for (std::size_t k = 0; k < roots.size(); ++k)
+      os << indent << "out[" << k << "]" << out_suffix << " = "
+         << code.at(roots[k]).first << ";\n";
+  };
+
+  os << "/* in[j]:";
+  for (std::size_t j = 0; j < vars.size(); ++j)
+    os << (j ? ", " : " ") << j << " = "
+       << static_cast<variable *>(vars[j])->label();
+  os << " */\n";
+  if (opts.cpp && opts.constexpr_fn)
+    os << "constexpr ";
+  os << "void " << opts.name << "(const double *in, double *out) {\n";
+  body("  ", "in[", "]", "", os);
+  os << "}\n";
+  if (opts.batch) {
+    char const *restrict = opts.cpp ? "__restrict" : "restrict";
+    os << "\nvoid " << opts.name << "_batch(" << (opts.cpp ? "std::" : "")
+       << "size_t n, const double *const " << restrict
+       << " *in, double *const " << restrict << " *out) {\n"
+       << "  for (" << (opts.cpp ? "std::" : "")
+       << "size_t i = 0; i < n; ++i) {\n";
+    body("    ", "in[", "][i]", "[i]", os);
+    os << "  }\n}\n";
+  }
+}
+
+// Read-only view of a whole file, memory-mapped where the platform allows
+// and read into memory otherwise.
+class mapped_file {
+private:
+  char const *base = nullptr;
+  std::size_t length = 0;
+  std::vector<char> copy;
+
+public:
+  explicit mapped_file(std::string const &path) {
+#if defined(__unix__)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("cannot open " + path);
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("cannot stat " + path);
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    if (length > 0) {
+      void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("cannot map " + path);
+      }
+      base = static_cast<char const *>(p);
+    }
+    ::close(fd);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      throw std::runtime_error("cannot open " + path);
+    copy.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+    base = copy.data();
+    length = copy.size();
+#endif
+  }
+
+  mapped_file(mapped_file const &) = delete;
+  mapped_file &operator=(mapped_file const &) = delete;
+
+  ~mapped_file() {
+#if defined(__unix__)
+    if (base)
+      munmap(const_cast<char *>(base), length);
+#endif
+  }
+
+  char const *data() const { return base; }
+  std::size_t size() const { return length; }
+};
+
+// Binary form of an expression DAG, in the writer's native byte order:
+//
+//   header    "SDAG", version, then the counts of the sections below
+//   constants double[constants]
+//   nodes     {kind:8 | count:24, first:32}[nodes], children first
+//   operands  uint32 node index[operands]
+//   roots     uint32 node index[roots]
+//   symbols   uint32 name offset[symbols + 1], then the name bytes
+//
+// A constant node's first indexes constants and a variable's indexes
+// symbols; any other node's count operands start at operands[first].
+// Sharing is kept: every node is stored once, however many parents it
+// has. A file written on a host of the other byte order fails the version
+// check rather than being misread.
+struct dag_header {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t nodes;
+  std::uint32_t operands;
+  std::uint32_t constants;
+  std::uint32_t symbols;
+  std::uint32_t roots;
+  std::uint32_t name_bytes;
+
+  static constexpr std::uint32_t current = 1;
+};
+
+struct dag_node {
+  std::uint32_t tag;
+  std::uint32_t first;
+
+  expr_kind kind() const { return static_cast<expr_kind>(tag & 0xff); }
+  std::uint32_t count() const { return tag >> 8; }
+};
+
+// Writes roots and everything they reach, in one pass over the DAG.
+void write_dag(std::ostream &os, std::vector<base_expr_s> const &roots) {
+  std::vector<base_expr_s> order = topo_order(roots);
+  std::unordered_map<base_expr const *, std::uint32_t> index;
+  index.reserve(order.size());
+  std::vector<dag_node> nodes;
+  std::vector<std::uint32_t> operands;
+  std::vector<std::double_t> constants;
+  std::vector<std::uint32_t> offsets{0};
+  std::string names;
+  std::unordered_map<std::uint32_t, std::uint32_t> symbols;
+  nodes.reserve(order.size());
+  for (base_expr_s node : order) {
+    dag_node rec{static_cast<std::uint32_t>(node->kind()), 0};
+    if (node->kind() == expr_kind::constant) {
+      rec.first = static_cast<std::uint32_t>(constants.size());
+      constants.push_back(static_cast<constant *>(node)->value());
+    } else if (node->kind() == expr_kind::variable) {
+      variable *v = static_cast<variable *>(node);
+      auto [it, fresh] = symbols.emplace(
+          v->symbol(), static_cast<std::uint32_t>(offsets.size() - 1));
+      if (fresh) {
+        names += v->label();
+        offsets.push_back(static_cast<std::uint32_t>(names.size()));
+      }
+      rec.first = it->second;
+    } else {
+      if (node->arity() >= 1u << 24)
+        throw std::length_error("node has too many operands to serialize");
+      rec.tag |= static_cast<std::uint32_t>(node->arity()) << 8;
+      rec.first = static_cast<std::uint32_t>(operands.size());
+      for (std::size_t i = 0; i < node->arity(); ++i)
+        operands.push_back(index.at(node->operand(i)));
+    }
+    index.emplace(node, static_cast<std::uint32_t>(nodes.size()));
+    nodes.push_back(rec);
+  }
+  std::vector<std::uint32_t> root_index;
+  for (base_expr_s root : roots)
+    root_index.push_back(index.at(root));
+
+  dag_header h{{'S', 'D', 'A', 'G'},
+               dag_header::current,
+               static_cast<std::uint32_t>(nodes.size()),
+               static_cast<std::uint32_t>(operands.size()),
+               static_cast<std::uint32_t>(constants.size()),
+               static_cast<std::uint32_t>(offsets.size() - 1),
+               static_cast<std::uint32_t>(root_index.size()),
+               static_cast<std::uint32_t>(names.size())};
+  auto put = [&os](auto const &items) {
+    os.write(reinterpret_cast<char const *>(items.data()),
+             static_cast<std::streamsize>(items.size() *
+                                          sizeof(items.data()[0])));
+  };
+  os.write(reinterpret_cast<char const *>(&h), sizeof h);
+  put(constants);
+  put(nodes);
+  put(operands);
+  put(root_index);
+  put(offsets);
+  put(names);
+}
+
+// A DAG written by write_dag, used in place: opening a file maps it and
+// checks its structure, without building a node or copying a table. It
+// can be evaluated straight from the mapping, or loaded into the current
+// session to be differentiated further.
+class dag_view {
+private:
+  std::shared_ptr<mapped_file> file;
+  dag_header header{};
+  std::double_t const *constants = nullptr;
+  dag_node const *nodes = nullptr;
+  std::uint32_t const *operands = nullptr;
+  std::uint32_t const *roots = nullptr;
+  std::uint32_t const *offsets = nullptr;
+  char const *names = nullptr;
+
+  [[noreturn]] static void corrupt(char const *what) {
+    throw std::runtime_error(std::string("bad expression file: ") + what);
+  }
+
+  void check() const {
+    for (std::uint32_t i = 0; i < header.nodes; ++i) {
+      dag_node const &n = nodes[i];
+      switch (n.kind()) {
+      case expr_kind::constant:
+        if (n.first >= header.constants || n.count() != 0)
+          corrupt("constant out of range");
+        continue;
+      case expr_kind::variable:
+        if (n.first >= header.symbols || n.count() != 0)
+          corrupt("symbol out of range");
+        continue;
+      case expr_kind::add:
+      case expr_kind::mul:
+        if (n.count() < 2)
+          corrupt("short sum or product");
+        break;
+      case expr_kind::ln:
+        if (n.count() != 1)
+          corrupt("wrong operand count");
+        break;
+      case expr_kind::sub:
+      case expr_kind::div:
+      case expr_kind::pow:
+        if (n.count() != 2)
+          corrupt("wrong operand count");
+        break;
+      default:
+        corrupt("unknown node kind");
+      }
+      if (std::uint64_t(n.first) + n.count() > header.operands)
+        corrupt("operands out of range");
+      for (std::uint32_t k = 0; k < n.count(); ++k)
+        if (operands[n.first + k] >= i)
+          corrupt("operand is not ordered before its node");
+    }
+    for (std::uint32_t r = 0; r < header.roots; ++r)
+      if (roots[r] >= header.nodes)
+        corrupt("root out of range");
+    for (std::uint32_t s = 0; s < header.symbols; ++s)
+      if (offsets[s] > offsets[s + 1] || offsets[s + 1] > header.name_bytes)
+        corrupt("symbol name out of range");
+  }
+
+public:
+  explicit dag_view(std::string const &path)
+      : file(std::make_shared<mapped_file>(path)) {
+    char const *p = file->data();
+    std::size_t size = file->size();
+    if (size < sizeof header)
+      corrupt("truncated header");
+    std::memcpy(&header, p, sizeof header);
+    if (std::memcmp(header.magic, "SDAG", 4) != 0)
+      corrupt("not an expression file");
+    if (header.version != dag_header::current)
+      corrupt("unsupported version");
+    std::uint64_t need = sizeof header + 8ull * header.constants +
+                         8ull * header.nodes + 4ull * header.operands +
+                         4ull * header.roots + 4ull * (header.symbols + 1ull) +
+                         header.name_bytes;
+    if (size != need)
+      corrupt("size does not match header");
+    p += sizeof header;
+    constants = reinterpret_cast<std::double_t const *>(p);
+    p += 8ull * header.constants;
+    nodes = reinterpret_cast<dag_node const *>(p);
+    p += 8ull * header.nodes;
+    operands = reinterpret_cast<std::uint32_t const *>(p);
+    p += 4ull * header.operands;
+    roots = reinterpret_cast<std::uint32_t const *>(p);
+    p += 4ull * header.roots;
+    offsets = reinterpret_cast<std::uint32_t const *>(p);
+    p += 4ull * (header.symbols + 1ull);
+    names = p;
+    check();
+  }
+
+  std::size_t size() const { return header.nodes; }
+  std::size_t root_count() const { return header.roots; }
+  std::size_t symbol_count() const { return header.symbols; }
+  std::string_view symbol(std::size_t i) const {
+    return {names + offsets[i], offsets[i + 1] - offsets[i]};
+  }
+
+  // Every root, with symbol i bound to values[i].
+  std::vector<std::double_t>
+  eval(std::vector<std::double_t> const &values) const {
+    if (values.size() != header.symbols)
+      throw std::invalid_argument("wrong number of variable values");
+    std::vector<std::double_t> regs(header.nodes);
+    for (std::uint32_t i = 0; i < header.nodes; ++i) {
+      dag_node const &n = nodes[i];
+      std::uint32_t const *ops = operands + n.first;
+      std::double_t &r = regs[i];
+      switch (n.kind()) {
+      case expr_kind::constant:
+        r = constants[n.first];
+        break;
+      case expr_kind::variable:
+        r = values[n.first];
+        break;
+      case expr_kind::add:
+        r = regs[ops[0]];
+        for (std::uint32_t k = 1; k < n.count(); ++k)
+          r += regs[ops[k]];
+        break;
+      case expr_kind::mul:
+        r = regs[ops[0]];
+        for (std::uint32_t k = 1; k < n.count(); ++k)
+          r *= regs[ops[k]];
+        break;
+      case expr_kind::sub:
+        r = regs[ops[0]] - regs[ops[1]];
+        break;
+      case expr_kind::div:
+        r = regs[ops[0]] / regs[ops[1]];
+        break;
+      case expr_kind::pow:
+        r = std::pow(regs[ops[0]], regs[ops[1]]);
+        break;
+      case expr_kind::ln:
+        r = std::log(regs[ops[0]]);
+        break;
+      case expr_kind::thunk:
+        // Rejected by check().
+        break;
+      }
+    }
+    std::vector<std::double_t> out;
+    for (std::uint32_t k = 0; k < header.roots; ++k)
+      out.push_back(regs[roots[k]]);
+    return out;
+  }
+
+  // The roots as nodes of the current session. check() has bounded every
+  // index, and each node is rebuilt through its factory, so a file that
+  // was edited or written by another version still yields simplified,
+  // canonical nodes.
+  std::vector<base_expr_s> load() const {
+    session::current().interned.reserve(header.nodes);
+    std::vector<base_expr_s> built(header.nodes);
+    std::vector<base_expr_s> ops;
+    for (std::uint32_t i = 0; i < header.nodes; ++i) {
+      dag_node const &n = nodes[i];
+      ops.clear();
+      for (std::uint32_t k = 0; k < n.count(); ++k)
+        ops.push_back(built[operands[n.first + k]]);
+      switch (n.kind()) {
+      case expr_kind::constant:
+        built[i] = constant::create(constants[n.first]);
+        break;
+      case expr_kind::variable:
+        built[i] = variable::create(std::string(symbol(n.first)));
+        break;
+      case expr_kind::add:
+        built[i] = add::create(ops);
+        break;
+      case expr_kind::mul:
+        built[i] = mul::create(ops);
+        break;
+      case expr_kind::sub:
+        built[i] = sub::create(ops[0], ops[1]);
+        break;
+      case expr_kind::div:
+        built[i] = div::create(ops[0], ops[1]);
+        break;
+      case expr_kind::pow:
+        built[i] = pow::create(ops[0], ops[1]);
+        break;
+      case expr_kind::ln:
+        built[i] = ln::create(ops[0]);
+        break;
+      case expr_kind::thunk:
+        break;
+      }
+    }
+    std::vector<base_expr_s> out;
+    for (std::uint32_t k = 0; k < header.roots; ++k)
+      out.push_back(built[roots[k]]);
+    return out;
+  }
+};
+
+// Derivatives kept on disk across runs, one write_dag file of (expression,
+// variable, derivative) per entry, named by the structural hash of the
+// expression and variable. Entries are written to a temporary file and
+// renamed into place, so readers never see a partial one. A hit refreshes
+// the file's mtime, and once the directory outgrows its limit the least
+// recently used entries are deleted, under a lock file so concurrent
+// sdiffe processes evict one at a time. Missing or damaged entries are
+// just misses.
+class disk_cache {
+private:
+  std::filesystem::path dir;
+  std::uint64_t limit;
+  std::atomic<std::uint64_t> approx_bytes{0};
+  std::atomic<std::uint64_t> writes{0};
+  std::mutex evicting;
+
+  static constexpr char const *suffix = ".sdag";
+
+  std::filesystem::path entry(base_expr_s e, base_expr_s dv) const {
+    char name[17];
+    std::snprintf(name, sizeof name, "%016llx",
+                  static_cast<unsigned long long>(
+                      hash_mix(e->hash(), dv->hash())));
+    return dir / (std::string(name) + suffix);
+  }
+
+  // Entries oldest first, with the directory's total size.
+  std::vector<std::pair<std::filesystem::file_time_type,
+                        std::filesystem::path>>
+  scan(std::uint64_t &total) const {
+    std::vector<
+        std::pair<std::filesystem::file_time_type, std::filesystem::path>>
+        entries;
+    std::error_code ec;
+    total = 0;
+    for (auto const &f : std::filesystem::directory_iterator(dir, ec)) {
+      if (f.path().extension() != suffix)
+        continue;
+      std::uint64_t size = f.file_size(ec);
+      auto mtime = f.last_write_time(ec);
+      if (ec)
+        continue;
+      total += size;
+      entries.emplace_back(mtime, f.path());
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+  }
+
+  // Deletes least recently used entries down to 90% of the limit.
+  void evict() {
+    std::lock_guard<std::mutex> guard(evicting);
+#if defined(__unix__)
+    int lock = ::open((dir / "lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock >= 0)
+      flock(lock, LOCK_EX);
+#endif
+    std::uint64_t total = 0;
+    auto entries = scan(total);
+    std::error_code ec;
+    for (auto const &[mtime, path] : entries) {
+      if (total <= limit / 10 * 9)
+        break;
+      std::uint64_t size = std::filesystem::file_size(path, ec);
+      if (!ec && std::filesystem::remove(path, ec))
+        total -= size;
+    }
+    approx_bytes = total;
+#if defined(__unix__)
+    if (lock >= 0)
+      ::close(lock); // releases the flock
+#endif
+  }
+
+public:
+  disk_cache(std::filesystem::path dir, std::uint64_t limit_bytes)
+      : dir(std::move(dir)), limit(limit_bytes) {
+    std::filesystem::create_directories(this->dir);
+    std::uint64_t total = 0;
+    scan(total);
+    approx_bytes = total;
+  }
+
+  // The cached derivative of e by dv, built in the current session, or
+  // nullptr.
+  base_expr_s find(base_expr_s e, base_expr_s dv) {
+    std::filesystem::path path = entry(e, dv);
+    try {
+      dag_view view(path.string());
+      if (view.root_count() != 3)
+        return nullptr;
+      std::vector<base_expr_s> roots = view.load();
+      // The stored expression and variable must match, not just the hash.
+      if (roots[0] != e || roots[1] != dv)
+        return nullptr;
+      std::error_code ec;
+      std::filesystem::last_write_time(
+          path, std::filesystem::file_time_type::clock::now(), ec);
+      return roots[2];
+    } catch (std::exception const &) {
+      return nullptr;
+    }
+  }
+
+  void store(base_expr_s e, base_expr_s dv, base_expr_s d) {
+    std::filesystem::path path = entry(e, dv);
+    std::filesystem::path tmp = path;
+    tmp += ".tmp." + std::to_string(::getpid()) + "." +
+           std::to_string(writes++);
+    {
+      std::ofstream os(tmp, std::ios::binary);
+      write_dag(os, {e, dv, d});
+      if (!os) {
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        return;
+      }
+    }
+    std::error_code ec;
+    std::uint64_t size = std::filesystem::file_size(tmp, ec);
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+      std::filesystem::remove(tmp, ec);
+      return;
+    }
+    if ((approx_bytes += size) > limit)
+      evict();
+  }
+};
+
+// Recursive-descent parser for one expression in infix form:
+//
+//   expr    := term (('+' | '-') term)*
+//   term    := unary (('*' | '/') unary)*
+//   unary   := '-' unary | power
+//   power   := primary ('^' unary)?
+//   primary := number | name | 'ln' '(' expr ')' | '(' expr ')'
+//
+// Tokens are views into the input, so nothing is copied per token. Runs of
+// '+' or '*' are gathered and built as one n-ary node.
+class parser {
+private:
+  enum class token { end, number, name, op };
+
+  std::string_view src;
+  std::size_t pos = 0;
+  token tok = token::end;
+  std::string_view text;
+  std::double_t number = 0;
+  std::size_t depth = 0;
+
+  static constexpr std::size_t max_depth = 4096;
+
+  [[noreturn]] void fail(std::string const &what) const {
+    throw std::runtime_error("parse error at column " +
+                             std::to_string(pos - text.size() + 1) + ": " +
+                             what);
+  }
+
+  void next() {
+    while (pos < src.size() &&
+           std::isspace(static_cast<unsigned char>(src[pos])))
+      ++pos;
+    std::size_t start = pos;
+    if (pos == src.size()) {
+      tok = token::end;
+    } else if (std::isdigit(static_cast<unsigned char>(src[pos])) ||
+               src[pos] == '.') {
+      auto [end, ec] =
+          std::from_chars(src.data() + pos, src.data() + src.size(), number);
+      if (ec != std::errc())
+        fail("malformed number");
+      pos = end - src.data();
+      tok = token::number;
+    } else if (std::isalpha(static_cast<unsigned char>(src[pos])) ||
+               src[pos] == '_') {
+      while (pos < src.size() &&
+             (std::isalnum(static_cast<unsigned char>(src[pos])) ||
+              src[pos] == '_'))
+        ++pos;
+      tok = token::name;
+    } else {
+      ++pos;
+      tok = token::op;
+    }
+    text = src.substr(start, pos - start);
+  }
+
+  bool accept(char op) {
+    if (tok != token::op || text[0] != op)
+      return false;
+    next();
+    return true;
+  }
+
+  void expect(char op) {
+    if (!accept(op))
+      fail(std::string("expected '") + op + "'");
+  }
+
+  base_expr_s expr() {
+    std::vector<base_expr_s> terms{term()};
+    while (true) {
+      if (accept('+')) {
+        terms.push_back(term());
+      } else if (accept('-')) {
+        base_expr_s lhs = add::create(terms);
+        terms.assign({sub::create(lhs, term())});
+      } else {
+        return add::create(terms);
+      }
+    }
+  }
+
+  base_expr_s term() {
+    std::vector<base_expr_s> factors{unary()};
+    while (true) {
+      if (accept('*')) {
+        factors.push_back(unary());
+      } else if (accept('/')) {
+        base_expr_s lhs = mul::create(factors);
+        factors.assign({div::create(lhs, unary())});
+      } else {
+        return mul::create(factors);
+      }
+    }
+  }
+
+  // Every level of nesting passes through here. Nesting is the only thing
+  // parsed recursively, so it is capped well within the native stack.
+  base_expr_s unary() {
+    if (++depth > max_depth)
+      fail("expression nested too deeply");
+    base_expr_s e = accept('-')
+                        ? mul::create(constant::create(-1), unary())
+                        : power();
+    --depth;
+    return e;
+  }
+
+  base_expr_s power() {
+    base_expr_s base = primary();
+    if (accept('^'))
+      return pow::create(base, unary());
+    return base;
+  }
+
+  base_expr_s primary() {
+    switch (tok) {
+    case token::number: {
+      std::double_t value = number;
+      next();
+      return constant::create(value);
+    }
+    case token::name: {
+      std::string_view name = text;
+      next();
+      if (name == "ln" && accept('(')) {
+        base_expr_s value = expr();
+        expect(')');
+        return ln::create(value);
+      }
+      return variable::create(std::string(name));
+    }
+    case token::op:
+      if (accept('(')) {
+        base_expr_s inner = expr();
+        expect(')');
+        return inner;
+      }
+      fail("unexpected '" + std::string(text) + "'");
+    case token::end:
+      break;
+    }
+    fail("unexpected end of input");
+  }
+
+  parser(std::string_view src) : src(src) { next(); }
+
+public:
+  static base_expr_s parse(std::string_view src) {
+    parser p(src);
+    base_expr_s e = p.expr();
+    if (p.tok != token::end)
+      p.fail("trailing input");
+    return e;
+  }
+};
+
+// Fixed set of worker threads with one task deque each. A worker takes
+// work from the back of its own deque and, once that is empty, steals from
+// the front of the others. Tasks submitted from outside the pool are dealt
+// round-robin. Each worker thread keeps its own default session, so nodes,
+// interning and caches are never shared between workers.
+class thread_pool {
+private:
+  struct queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<queue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex idle_lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::atomic<std::size_t> queued{0};
+  std::atomic<std::size_t> unfinished{0};
+  std::atomic<std::size_t> next_queue{0};
+  bool stopping = false;
+  // The first exception a task let out since the last wait().
+  std::exception_ptr failure;
+
+  static std::size_t &self() {
+    static thread_local std::size_t index = SIZE_MAX;
+    return index;
+  }
+
+  bool try_run(std::size_t home) {
+    std::function<void()> task;
+    for (std::size_t i = 0; i < queues.size() && !task; ++i) {
+      queue &q = *queues[(home + i) % queues.size()];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (q.tasks.empty())
+        continue;
+      if (i == 0) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+    }
+    if (!task)
+      return false;
+    --queued;
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      if (!failure)
+        failure = std::current_exception();
+    }
+    if (--unfinished == 0) {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      done.notify_all();
+    }
+    return true;
+  }
+
+  void work(std::size_t index) {
+    self() = index;
+    while (true) {
+      if (try_run(index))
+        continue;
+      std::unique_lock<std::mutex> guard(idle_lock);
+      wake.wait(guard, [this] { return stopping || queued > 0; });
+      if (stopping && queued == 0)
+        return;
+    }
+  }
+
+public:
+  explicit thread_pool(std::size_t threads) {
+    threads = std::max<std::size_t>(threads, 1);
+    for (std::size_t i = 0; i < threads; ++i)
+      queues.emplace_back(new queue);
+    for (std::size_t i = 0; i < threads; ++i)
+      workers.emplace_back([this, i] { work(i); });
+  }
+
+  thread_pool(thread_pool const &) = delete;
+  thread_pool &operator=(thread_pool const &) = delete;
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : workers)
+      t.join();
+  }
+
+  std::size_t size() const { return workers.size(); }
+
+  void submit(std::function<void()> task) {
+    std::size_t home = self() < queues.size()
+                           ? self()
+                           : next_queue++ % queues.size();
+    ++unfinished;
+    {
+      std::lock_guard<std::mutex> guard(queues[home]->lock);
+      queues[home]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      ++queued;
+    }
+    wake.notify_one();
+  }
+
+  // Blocks until every submitted task has finished, then rethrows the
+  // first exception one of them threw. Must not be called from a worker
+  // thread.
+  void wait() {
+    std::unique_lock<std::mutex> guard(idle_lock);
+    done.wait(guard, [this] { return unfinished == 0; });
+    if (std::exception_ptr e = std::exchange(failure, nullptr))
+      std::rethrow_exception(e);
+  }
+};
+
+// Shares a session for as long as it is alive, leaving one that was
+// already shared as it was.
+class shared_session {
+private:
+  session &s;
+  bool was_shared;
+
+public:
+  shared_session(session &s) : s(s), was_shared(s.is_shared()) {
+    if (!was_shared)
+      s.share(true);
+  }
+  shared_session(shared_session const &) = delete;
+  shared_session &operator=(shared_session const &) = delete;
+  ~shared_session() {
+    if (!was_shared)
+      s.share(false);
+  }
+};
+
+// The nodes e points at directly. Unlike operand(), this leaves thunks
+// as they are and lists what a thunk refers to, expanded or not.
+template <typename F> void for_each_link(base_expr_s e, F const &f) {
+  switch (e->kind()) {
+  case expr_kind::add:
+    for (std::size_t i = 0; i < static_cast<add *>(e)->size(); ++i)
+      f(static_cast<add *>(e)->operand(i));
+    break;
+  case expr_kind::mul:
+    for (std::size_t i = 0; i < static_cast<mul *>(e)->size(); ++i)
+      f(static_cast<mul *>(e)->operand(i));
+    break;
+  case expr_kind::sub:
+    f(static_cast<sub *>(e)->operand(0));
+    f(static_cast<sub *>(e)->operand(1));
+    break;
+  case expr_kind::div:
+    f(static_cast<class div *>(e)->operand(0));
+    f(static_cast<class div *>(e)->operand(1));
+    break;
+  case expr_kind::pow:
+    f(static_cast<class pow *>(e)->operand(0));
+    f(static_cast<class pow *>(e)->operand(1));
+    break;
+  case expr_kind::ln:
+    f(static_cast<ln *>(e)->operand(0));
+    break;
+  case expr_kind::thunk: {
+    thunk *t = static_cast<thunk *>(e);
+    f(t->subject());
+    f(t->wrt());
+    if (base_expr_s d = t->expansion())
+      f(d);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// e with every thunk under it expanded and each node above one rebuilt
+// through its factory. Operands that were thunks when their parent was
+// built sit where the thunk's hash sorted them and miss the folds their
+// expansion would have allowed, so only the rebuilt nodes are the ones
+// diff() gives. Each expanded thunk's result is entered in the derivative
+// cache, so later diff() and lazy_diff() calls return it directly.
+base_expr_s settle(base_expr_s e) {
+  session &s = session::current();
+  std::unordered_map<base_expr const *, base_expr_s> settled;
+  std::vector<std::pair<base_expr_s, bool>> stack{{e, false}};
+  std::vector<base_expr_s> links;
+  while (!stack.empty()) {
+    auto [node, expanded] = stack.back();
+    if (settled.count(node)) {
+      stack.pop_back();
+      continue;
+    }
+    thunk *t = expr_cast<thunk>(node);
+    links.clear();
+    if (t)
+      links.push_back(t->force());
+    else
+      for_each_link(node, [&](base_expr_s c) { links.push_back(c); });
+    if (!expanded) {
+      stack.back().second = true;
+      for (base_expr_s c : links)
+        if (!settled.count(c))
+          stack.emplace_back(c, false);
+      continue;
+    }
+    stack.pop_back();
+    bool same = true;
+    for (base_expr_s &c : links) {
+      base_expr_s done = settled.at(c);
+      same = same && done == c;
+      c = done;
+    }
+    base_expr_s out = t ? links[0] : same ? node : rebuild(node, links);
+    if (t)
+      s.derivatives.insert(t->subject(), t->wrt(), out);
+    settled.emplace(node, out);
+  }
+  return settled.at(e);
+}
+
+std::vector<base_expr_s>
+session::collect(session &next, std::vector<base_expr_s> const &roots) {
+  // Live nodes in post-order, which is the order they are copied in.
+  std::vector<base_expr_s> order;
+  std::unordered_set<base_expr const *> live;
+  std::vector<std::pair<base_expr_s, bool>> stack;
+  auto mark = [&](base_expr_s root) {
+    if (live.count(root))
+      return;
+    stack.emplace_back(root, false);
+    while (!stack.empty()) {
+      auto [node, expanded] = stack.back();
+      if (expanded) {
+        stack.pop_back();
+        if (live.insert(node).second)
+          order.push_back(node);
+        continue;
+      }
+      stack.back().second = true;
+      for_each_link(node, [&](base_expr_s c) {
+        if (!live.count(c))
+          stack.emplace_back(c, false);
+      });
+    }
+  };
+  for (base_expr_s root : roots)
+    mark(root);
+
+  // A cached derivative of a live node lives on, and can make further
+  // entries live in turn.
+  auto entries = derivatives.snapshot();
+  std::vector<bool> kept(entries.size(), false);
+  for (bool grew = true; grew;) {
+    grew = false;
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+      auto [e, dv, d] = entries[i];
+      if (kept[i] || !live.count(e) || !live.count(dv))
+        continue;
+      kept[i] = true;
+      grew = true;
+      mark(d);
+    }
+  }
+
+  session_scope scope(next);
+  intern_table &table = next.interned;
+  table.reserve(order.size());
+  std::unordered_map<base_expr const *, base_expr_s> moved;
+  std::vector<base_expr_s> ops;
+  for (base_expr_s node : order) {
+    ops.clear();
+    for_each_link(node, [&](base_expr_s c) { ops.push_back(moved.at(c)); });
+    base_expr_s copy = nullptr;
+    switch (node->kind()) {
+    case expr_kind::constant:
+      copy = constant::create(static_cast<constant *>(node)->value());
+      break;
+    case expr_kind::variable:
+      copy = variable::create(static_cast<class variable *>(node)->label());
+      break;
+    case expr_kind::add:
+      copy = table.get_nary<add>(ops);
+      break;
+    case expr_kind::mul:
+      copy = table.get_nary<mul>(ops);
+      break;
+    case expr_kind::sub:
+      copy = table.get<sub>({sub::tag, ops[0], ops[1]}, ops[0], ops[1]);
+      break;
+    case expr_kind::div:
+      copy = table.get<class div>({div::tag, ops[0], ops[1]}, ops[0], ops[1]);
+      break;
+    case expr_kind::pow:
+      copy = table.get<class pow>({pow::tag, ops[0], ops[1]}, ops[0], ops[1]);
+      break;
+    case expr_kind::ln:
+      copy = table.get<ln>({ln::tag, ops[0]}, ops[0]);
+      break;
+    case expr_kind::thunk:
+      copy = table.get<thunk>({thunk::tag, ops[0], ops[1]}, ops[0], ops[1]);
+      if (ops.size() == 3)
+        static_cast<thunk *>(copy)->forced.store(ops[2]);
+      break;
+    }
+    moved.emplace(node, copy);
+  }
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    auto [e, dv, d] = entries[i];
+    if (kept[i])
+      next.derivatives.insert(moved.at(e), moved.at(dv), moved.at(d));
+  }
+
+  std::vector<base_expr_s> out;
+  for (base_expr_s root : roots)
+    out.push_back(moved.at(root));
+  return out;
+}
+
+// A session for a long-running service, renewed generation by
+// generation. Threads take the current generation and enter it; collect()
+// copies the live expressions into a fresh one and publishes it, without
+// waiting for anyone. A thread holding an older generation keeps it alive
+// and can finish its work there, and the old arena is freed, in one piece,
+// when its last holder lets go.
+class session_generations {
+private:
+  std::mutex lock;
+  std::shared_ptr<session> live;
+
+public:
+  session_generations() : live(std::make_shared<session>()) {
+    live->share(true);
+  }
+  session_generations(session_generations const &) = delete;
+  session_generations &operator=(session_generations const &) = delete;
+
+  std::shared_ptr<session> current() {
+    std::lock_guard<std::mutex> guard(lock);
+    return live;
+  }
+
+  // roots, which must be nodes of the current generation, as nodes of the
+  // next one. Collections are meant to run one at a time.
+  std::vector<base_expr_s> collect(std::vector<base_expr_s> const &roots) {
+    std::shared_ptr<session> old = current();
+    auto next = std::make_shared<session>();
+    std::vector<base_expr_s> out = old->collect(*next, roots);
+    next->share(true);
+    std::lock_guard<std::mutex> guard(lock);
+    live = std::move(next);
+    return out;
+  }
+};
+
+// Runs f(i) for every i in [0, n), on pool when there is one. The workers
+// enter the caller's session, so whatever they build stays hash-consed
+// with the caller's nodes.
+template <typename F>
+void parallel_for(thread_pool *pool, std::size_t n, F const &f) {
+  if (!pool || n < 2) {
+    for (std::size_t i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+  session &s = session::current();
+  shared_session sharing(s);
+  for (std::size_t i = 0; i < n; ++i)
+    pool->submit([&s, &f, i] {
+      session_scope scope(s);
+      f(i);
+    });
+  pool->wait();
+}
+
+// J[i][j] = d exprs[i] / d vars[j]. Entries are independent diff() calls
+// and are spread over pool; since the derivative cache is shared, a subterm
+// common to several rows is still differentiated once per variable.
+std::vector<std::vector<base_expr_s>>
+jacobian(std::vector<base_expr_s> const &exprs,
+         std::vector<base_expr_s> const &vars, thread_pool *pool = nullptr) {
+  std::vector<std::vector<base_expr_s>> jac(
+      exprs.size(), std::vector<base_expr_s>(vars.size()));
+  parallel_for(pool, exprs.size() * vars.size(), [&](std::size_t k) {
+    std::size_t i = k / vars.size(), j = k % vars.size();
+    jac[i][j] = exprs[i]->diff(vars[j]);
+  });
+  return jac;
+}
+
+// A sparse matrix of expressions in compressed sparse row form: row i
+// holds values[offsets[i]..offsets[i + 1]), in the columns given by the
+// same range of index, in increasing order.
+struct sparse_matrix {
+  std::size_t rows = 0;
+  std::size_t cols = 0;
+  std::vector<std::size_t> offsets{0};
+  std::vector<std::uint32_t> index;
+  std::vector<base_expr_s> values;
+
+  std::size_t nonzeros() const { return values.size(); }
+
+  // The entry at (i, j), or nullptr when it is structurally zero.
+  base_expr_s at(std::size_t i, std::size_t j) const {
+    auto first = index.begin() + offsets[i];
+    auto last = index.begin() + offsets[i + 1];
+    auto it = std::lower_bound(first, last, j);
+    return it != last && *it == j ? values[it - index.begin()] : nullptr;
+  }
+
+  // The transpose, which is this matrix in compressed sparse column form.
+  sparse_matrix transposed() const {
+    sparse_matrix t;
+    t.rows = cols;
+    t.cols = rows;
+    t.offsets.assign(cols + 1, 0);
+    for (std::uint32_t j : index)
+      ++t.offsets[j + 1];
+    for (std::size_t j = 0; j < cols; ++j)
+      t.offsets[j + 1] += t.offsets[j];
+    t.index.resize(index.size());
+    t.values.resize(values.size());
+    std::vector<std::size_t> next(t.offsets.begin(), t.offsets.end() - 1);
+    for (std::size_t i = 0; i < rows; ++i) {
+      for (std::size_t k = offsets[i]; k < offsets[i + 1]; ++k) {
+        std::size_t slot = next[index[k]]++;
+        t.index[slot] = static_cast<std::uint32_t>(i);
+        t.values[slot] = values[k];
+      }
+    }
+    return t;
+  }
+};
+
+// The Jacobian of exprs in vars as a sparse_matrix. Each row is
+// differentiated only by the variables that occur in it, found by walking
+// the expression, so the work is proportional to the size of the
+// expressions plus the nonzeros rather than to rows * columns; inside a
+// row, diff() skips independent subtrees by their masks. Entries that
+// simplify to 0 are dropped. Rows are spread over pool.
+sparse_matrix sparse_jacobian(std::vector<base_expr_s> const &exprs,
+                              std::vector<base_expr_s> const &vars,
+                              thread_pool *pool = nullptr) {
+  std::unordered_map<base_expr const *, std::uint32_t> column;
+  for (std::size_t j = 0; j < vars.size(); ++j)
+    column.emplace(vars[j], static_cast<std::uint32_t>(j));
+
+  std::vector<std::vector<std::pair<std::uint32_t, base_expr_s>>> rows(
+      exprs.size());
+  parallel_for(pool, exprs.size(), [&](std::size_t i) {
+    std::vector<std::uint32_t> cols;
+    for (base_expr_s node : topo_order({exprs[i]})) {
+      if (node->kind() != expr_kind::variable)
+        continue;
+      auto it = column.find(node);
+      if (it != column.end())
+        cols.push_back(it->second);
+    }
+    std::sort(cols.begin(), cols.end());
+    for (std::uint32_t j : cols) {
+      base_expr_s d = exprs[i]->diff(vars[j]);
+      constant *c = expr_cast<constant>(d);
+      if (!c || c->value() != 0)
+        rows[i].emplace_back(j, d);
+    }
+  });
+
+  sparse_matrix jac;
+  jac.rows = exprs.size();
+  jac.cols = vars.size();
+  for (auto const &row : rows) {
+    for (auto const &[j, d] : row) {
+      jac.index.push_back(j);
+      jac.values.push_back(d);
+    }
+    jac.offsets.push_back(jac.values.size());
+  }
+  return jac;
+}
+
+// H[i][j] = d^2 expr / d vars[i] d vars[j]. The gradient comes from one
+// reverse sweep; only the upper triangle of second derivatives is built,
+// in parallel, and mirrored into the lower one.
+std::vector<std::vector<base_expr_s>>
+hessian(base_expr_s expr, std::vector<base_expr_s> const &vars,
+        thread_pool *pool = nullptr) {
+  std::size_t n = vars.size();
+  std::vector<base_expr_s> grad = gradient(expr, vars);
+  std::vector<std::vector<base_expr_s>> hess(n, std::vector<base_expr_s>(n));
+  parallel_for(pool, n * (n + 1) / 2, [&](std::size_t k) {
+    // k walks the upper triangle row by row.
+    std::size_t i = 0;
+    while (k >= n - i)
+      k -= n - i++;
+    std::size_t j = i + k;
+    hess[i][j] = hess[j][i] = grad[i]->diff(vars[j]);
+  });
+  return hess;
+}
+
+void engine_stats::report(std::ostream &os) const {
+  static char const *const kinds[kind_count] = {
+      "constant", "variable", "add", "sub", "mul",
+      "div",      "pow",      "ln",  "thunk"};
+  static char const *const rules[rewrite_count] = {
+      "constant_fold", "add_zero", "sub_zero", "sub_self", "div_one",
+      "div_zero",      "pow_zero", "pow_one",  "ln_e",     "mul_one",
+      "mul_zero",      "like_terms", "collapse"};
+  auto ms = [](counter const &ns) { return ns.get() / 1e6; };
+
+  os << "kind\tbuilt\treused\n";
+  for (std::size_t k = 0; k < kind_count; ++k)
+    os << kinds[k] << '\t' << created[k].get() << '\t' << reused[k].get()
+       << '\n';
+  os << "rewrites:";
+  for (std::size_t r = 0; r < rewrite_count; ++r)
+    os << ' ' << rules[r] << '=' << rewrites[r].get();
+  os << "\nderivatives: " << derived.get() << " derived ("
+     << derived_poly.get() << " as polynomials), " << derivative_hits.get()
+     << " cache hits, " << mask_skips.get() << " skipped as independent, "
+     << forced.get() << " thunks expanded; disk cache "
+     << disk_hits.get() << " hits, " << disk_stores.get() << " stores\n";
+  os << "nodes: " << input_nodes.get() << " in, " << output_nodes.get()
+     << " out";
+  if (worst_input.get() > 0)
+    os << "; worst swell on line " << worst_line.get() << ": "
+       << worst_input.get() << " -> " << worst_output.get();
+  os << "\ntime: parse " << ms(parse_ns) << " ms, diff " << ms(diff_ns)
+     << " ms, print " << ms(print_ns) << " ms\n";
+}
+
+class serve_sessions;
+
+// Settings for differentiate_stream.
+struct stream_options {
+  std::string var = "x";
+  // Which derivative differentiate_lines prints; see nth_diff.
+  std::size_t order = 1;
+  print_format format = print_format::infix;
+  // Also measure node counts and phase times into engine_stats.
+  bool stats = false;
+  // Write a C or C++ function per line instead, computing the expression
+  // and its derivative; see emit_code.
+  std::optional<codegen_options> emit;
+  // Looked up before differentiating; derivatives that took longer than
+  // cache_after to compute are stored in it.
+  disk_cache *cache = nullptr;
+  std::chrono::microseconds cache_after{1000};
+  thread_pool *pool = nullptr;
+  // Where serve_stream answers requests; one of its own when null.
+  serve_sessions *sessions = nullptr;
+};
+
+// A run of input lines and, at the same indexes, their output or error.
+struct line_chunk {
+  std::vector<std::string> lines;
+  std::vector<std::string> results;
+  std::vector<std::string> errors;
+  std::size_t first_line = 0;
+};
+
+// Function f<line> over the variables of e in name order, computing e into
+// out[0] and d into out[1].
+void emit_line(base_expr_s e, base_expr_s d, std::size_t line,
+               codegen_options opts, std::string &out) {
+  std::vector<base_expr_s> vars;
+  for (base_expr_s node : topo_order({e}))
+    if (node->kind() == expr_kind::variable)
+      vars.push_back(node);
+  std::sort(vars.begin(), vars.end(), [](base_expr_s a, base_expr_s b) {
+    return static_cast<variable *>(a)->label() <
+           static_cast<variable *>(b)->label();
+  });
+  opts.name += std::to_string(line);
+  std::ostringstream os;
+  os << '\n';
+  emit_code(os, {e, d}, vars, opts);
+  out += os.str();
+}
+
+// d(e)/d(dv), taken from opts.cache when it is there. One computed here
+// that took at least cache_after is stored in it.
+base_expr_s derive_cached(base_expr_s e, base_expr_s dv,
+                          stream_options const &opts) {
+  using clock = std::chrono::steady_clock;
+  if (!opts.cache)
+    return e->diff(dv);
+  engine_stats &stats = engine_stats::local();
+  if (base_expr_s d = opts.cache->find(e, dv)) {
+    stats.disk_hits.add();
+    return d;
+  }
+  clock::time_point t0 = clock::now();
+  base_expr_s d = e->diff(dv);
+  if (clock::now() - t0 >= opts.cache_after) {
+    opts.cache->store(e, dv, d);
+    stats.disk_stores.add();
+  }
+  return d;
+}
+
+// Differentiates c.lines[begin, end) using the calling thread's default
+// session.
+void differentiate_lines(line_chunk &c, std::size_t begin, std::size_t end,
+                         stream_options const &opts) {
+  using clock = std::chrono::steady_clock;
+  constexpr std::size_t session_bytes = 256 << 20;
+  session::recycle(session_bytes);
+  engine_stats &stats = engine_stats::local();
+  base_expr_s dv = variable::create(opts.var);
+  for (std::size_t i = begin; i < end; ++i) {
+    std::string const &line = c.lines[i];
+    if (line.find_first_not_of(" \t\r") == std::string::npos)
+      continue;
+    try {
+      clock::time_point t0 = opts.stats ? clock::now() : clock::time_point();
+      base_expr_s e = parser::parse(line);
+      clock::time_point t1 = opts.stats ? clock::now() : t0;
+      // The disk cache holds first derivatives only.
+      base_expr_s d = opts.order == 1 ? derive_cached(e, dv, opts)
+                                      : nth_diff(e, dv, opts.order);
+      clock::time_point t2 = opts.stats ? clock::now() : t1;
+      std::string &out = c.results[i];
+      if (opts.emit) {
+        emit_line(e, d, c.first_line + i + 1, *opts.emit, out);
+      } else {
+        serialize(e, out, opts.format);
+        out += "\t:\t";
+        serialize(d, out, opts.format);
+        out += '\n';
+      }
+      if (opts.stats) {
+        auto ns = [](clock::duration d) {
+          return static_cast<std::uint64_t>(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(d)
+                  .count());
+        };
+        stats.parse_ns.add(ns(t1 - t0));
+        stats.diff_ns.add(ns(t2 - t1));
+        stats.print_ns.add(ns(clock::now() - t2));
+        std::uint64_t in = topo_order({e}).size();
+        std::uint64_t out = topo_order({d}).size();
+        stats.input_nodes.add(in);
+        stats.output_nodes.add(out);
+        stats.note_swell(in, out, c.first_line + i + 1);
+      }
+    } catch (std::exception const &ex) {
+      c.errors[i] = ex.what();
+    }
+  }
+}
+
+// Reads one expression per line and writes "expr : derivative" lines, in
+// input order. Input goes through in chunks: with a pool, a chunk is split
+// into tasks spread over the workers while the next chunk is being read.
+// Only a chunk or two is ever held in memory, and each thread's session is
+// recycled once its arena grows large, so memory stays bounded on
+// arbitrarily long streams. Returns the number of lines that failed.
+std::size_t differentiate_stream(std::istream &in, std::ostream &out,
+                                 stream_options const &opts) {
+  constexpr std::size_t chunk_lines = 16384;
+  constexpr std::size_t task_lines = 256;
+
+  line_chunk buffers[2];
+  std::size_t lineno = 0;
+  std::size_t failed = 0;
+
+  auto read = [&](line_chunk &c) {
+    c.lines.resize(chunk_lines);
+    c.first_line = lineno;
+    std::size_t n = 0;
+    while (n < chunk_lines && std::getline(in, c.lines[n]))
+      ++n;
+    c.lines.resize(n);
+    c.results.assign(n, std::string());
+    c.errors.assign(n, std::string());
+    lineno += n;
+    return n > 0;
+  };
+  auto start = [&](line_chunk &c) {
+    if (!opts.pool) {
+      differentiate_lines(c, 0, c.lines.size(), opts);
+      return;
+    }
+    for (std::size_t i = 0; i < c.lines.size(); i += task_lines) {
+      std::size_t end = std::min(i + task_lines, c.lines.size());
+      opts.pool->submit(
+          [&c, i, end, &opts] { differentiate_lines(c, i, end, opts); });
+    }
+  };
+  auto write = [&](line_chunk &c) {
+    for (std::size_t i = 0; i < c.lines.size(); ++i) {
+      if (!c.errors[i].empty()) {
+        std::cerr << "sdiffe: line " << c.first_line + i + 1 << ": "
+                  << c.errors[i] << '\n';
+        ++failed;
+      }
+      out << c.results[i];
+    }
+  };
+
+  std::size_t current = 0;
+  bool more = read(buffers[current]);
+  while (more) {
+    start(buffers[current]);
+    more = read(buffers[current ^ 1]);
+    if (opts.pool)
+      opts.pool->wait();
+    write(buffers[current]);
+    current ^= 1;
+  }
+  out.flush();
+  return failed;
+}
+
+// Splits the first whitespace-delimited word off rest.
+inline std::string_view next_word(std::string_view &rest) {
+  std::size_t begin = rest.find_first_not_of(" \t");
+  if (begin == std::string_view::npos) {
+    rest = {};
+    return {};
+  }
+  std::size_t end = std::min(rest.find_first_of(" \t", begin), rest.size());
+  std::string_view word = rest.substr(begin, end - begin);
+  rest.remove_prefix(end);
+  return word;
+}
+
+// The session generations a server answers requests in, shared by its
+// workers and connections. Each diff request's expression and variable
+// are remembered, up to the last `kept`. Once the live generation has
+// grown past max_bytes, the request that notices collects it: the
+// remembered expressions move to a fresh generation with the derivatives
+// cached for them, and the rest is freed once the requests still running
+// in the old generation are done.
+class serve_sessions {
+private:
+  session_generations generations;
+  std::mutex lock;
+  std::mutex collecting;
+  // The generation the nodes in recent belong to.
+  std::shared_ptr<session> owner;
+  std::deque<base_expr_s> recent;
+
+public:
+  std::size_t max_bytes = 256 << 20;
+  std::size_t kept = 4096;
+
+  std::shared_ptr<session> current() { return generations.current(); }
+
+  // Keeps roots, nodes of gen, warm across the next collection. Roots of
+  // a generation that has been collected already are dropped.
+  void remember(std::shared_ptr<session> const &gen,
+                std::vector<base_expr_s> const &roots) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (gen != owner) {
+      if (gen != generations.current())
+        return;
+      owner = gen;
+      recent.clear();
+    }
+    recent.insert(recent.end(), roots.begin(), roots.end());
+    while (recent.size() > kept)
+      recent.pop_front();
+  }
+
+  // Collects the live generation if it has outgrown max_bytes and no other
+  // thread is collecting it already.
+  void maybe_collect() {
+    if (current()->nodes().bytes() <= max_bytes)
+      return;
+    std::unique_lock<std::mutex> one(collecting, std::try_to_lock);
+    // generations only changes under `collecting`, so gen stays current.
+    std::shared_ptr<session> gen = current();
+    if (!one || gen->nodes().bytes() <= max_bytes)
+      return;
+    std::vector<base_expr_s> roots;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (owner == gen)
+        roots.assign(recent.begin(), recent.end());
+    }
+    std::vector<base_expr_s> moved = generations.collect(roots);
+    std::lock_guard<std::mutex> guard(lock);
+    owner = generations.current();
+    recent.assign(moved.begin(), moved.end());
+  }
+};
+
+// Answers the requests in c.lines[begin, end), one per line, in the live
+// generation of opts.sessions:
+//
+//   ID diff VAR EXPR          ID ok EXPR : DERIVATIVE
+//   ID eval VAR=NUM,... EXPR  ID ok VALUE
+//
+// or "ID error MESSAGE". ID is any word, echoed back. eval goes through
+// jit_function::compile, so repeated expressions run cached native code.
+void serve_lines(line_chunk &c, std::size_t begin, std::size_t end,
+                 stream_options const &opts) {
+  std::shared_ptr<session> gen = opts.sessions->current();
+  std::vector<base_expr_s> warm;
+  session_scope scope(*gen);
+  for (std::size_t i = begin; i < end; ++i) {
+    std::string_view rest = c.lines[i];
+    std::string_view id = next_word(rest);
+    if (id.empty())
+      continue;
+    std::string &out = c.results[i];
+    out.append(id.data(), id.size());
+    try {
+      std::string_view verb = next_word(rest);
+      std::string_view arg = next_word(rest);
+      if (verb == "diff") {
+        base_expr_s e = parser::parse(rest);
+        base_expr_s dv = variable::create(std::string(arg));
+        base_expr_s d = derive_cached(e, dv, opts);
+        warm.push_back(e);
+        warm.push_back(dv);
+        out += " ok ";
+        serialize(e, out, opts.format);
+        out += "\t:\t";
+        serialize(d, out, opts.format);
+      } else if (verb == "eval") {
+        std::vector<base_expr_s> vars;
+        std::vector<std::double_t> values;
+        while (!arg.empty()) {
+          std::size_t comma = std::min(arg.find(','), arg.size());
+          std::string_view binding = arg.substr(0, comma);
+          arg.remove_prefix(std::min(comma + 1, arg.size()));
+          std::size_t eq = binding.find('=');
+          if (eq == std::string_view::npos || eq == 0)
+            throw std::runtime_error("expected VAR=NUM");
+          std::string value(binding.substr(eq + 1));
+          char *stop = nullptr;
+          values.push_back(std::strtod(value.c_str(), &stop));
+          if (value.empty() || *stop != '\0')
+            throw std::runtime_error("bad number: " + value);
+          vars.push_back(variable::create(std::string(binding.substr(0, eq))));
+        }
+        base_expr_s e = parser::parse(rest);
+        std::double_t v = (*jit_function::compile(e, vars))(values.data());
+        char buf[32];
+        auto r = std::to_chars(buf, buf + sizeof buf, v);
+        out += " ok ";
+        out.append(buf, r.ptr);
+      } else {
+        throw std::runtime_error("unknown request: " + std::string(verb));
+      }
+    } catch (std::exception const &ex) {
+      out.resize(id.size());
+      out += " error ";
+      out += ex.what();
+    }
+    out += '\n';
+  }
+  opts.sessions->remember(gen, warm);
+  opts.sessions->maybe_collect();
+}
+
+// Requests read together, answered together.
+struct request_batch {
+  line_chunk chunk;
+  std::mutex lock;
+  std::condition_variable finished;
+  std::size_t tasks = 0;
+};
+
+// Serves requests from in until it ends; see serve_lines. Each read takes
+// one request and then whatever else has already arrived, up to a batch,
+// so a busy client's requests are batched and a lone request is not held
+// back waiting for company. With a pool, batches are spread over the
+// workers as soon as they are read and a writer thread sends their
+// answers back in request order, so a client may pipeline requests
+// without waiting for answers. All workers answer in one session
+// generation, see serve_sessions, so the intern table and the derivative
+// cache stay warm from one request to the next, whichever worker takes it.
+// Returns the number of requests read.
+std::size_t serve_stream(std::istream &in, std::ostream &out,
+                         stream_options const &opts) {
+  if (!opts.sessions) {
+    serve_sessions sessions;
+    stream_options with = opts;
+    with.sessions = &sessions;
+    return serve_stream(in, out, with);
+  }
+  constexpr std::size_t batch_lines = 4096;
+  constexpr std::size_t task_lines = 64;
+
+  auto write = [&](line_chunk const &c) {
+    for (std::string const &r : c.results)
+      out << r;
+    out.flush();
+  };
+
+  std::mutex queue_lock;
+  std::condition_variable queued;
+  std::deque<std::shared_ptr<request_batch>> queue;
+  bool closed = false;
+  std::thread writer;
+  if (opts.pool)
+    writer = std::thread([&] {
+      for (;;) {
+        std::unique_lock<std::mutex> guard(queue_lock);
+        queued.wait(guard, [&] { return closed || !queue.empty(); });
+        if (queue.empty())
+          return;
+        std::shared_ptr<request_batch> b = std::move(queue.front());
+        queue.pop_front();
+        guard.unlock();
+        std::unique_lock<std::mutex> done(b->lock);
+        b->finished.wait(done, [&] { return b->tasks == 0; });
+        write(b->chunk);
+      }
+    });
+
+  std::size_t served = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    auto b = std::make_shared<request_batch>();
+    line_chunk &c = b->chunk;
+    c.lines.push_back(std::move(line));
+    while (c.lines.size() < batch_lines && in.rdbuf()->in_avail() > 0 &&
+           std::getline(in, line))
+      c.lines.push_back(std::move(line));
+    std::size_t n = c.lines.size();
+    c.results.assign(n, std::string());
+    c.first_line = served;
+    served += n;
+    if (!opts.pool) {
+      serve_lines(c, 0, n, opts);
+      write(c);
+      continue;
+    }
+    b->tasks = (n + task_lines - 1) / task_lines;
+    {
+      std::lock_guard<std::mutex> guard(queue_lock);
+      queue.push_back(b);
+    }
+    queued.notify_one();
+    for (std::size_t i = 0; i < n; i += task_lines) {
+      std::size_t end = std::min(i + task_lines, n);
+      opts.pool->submit([b, i, end, &opts] {
+        serve_lines(b->chunk, i, end, opts);
+        std::lock_guard<std::mutex> guard(b->lock);
+        if (--b->tasks == 0)
+          b->finished.notify_all();
+      });
+    }
+  }
+  if (writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(queue_lock);
+      closed = true;
+    }
+    queued.notify_one();
+    writer.join();
+  }
+  return served;
+}
+
+#if defined(__unix__)
+// A buffered stream over a connected socket, so serve_stream can
+// talk to a connection like to standard input and output.
+class fd_streambuf : public std::streambuf {
+private:
+  int fd;
+  std::vector<char> in_buf = std::vector<char>(1 << 16);
+  std::vector<char> out_buf = std::vector<char>(1 << 16);
+
+public:
+  explicit fd_streambuf(int fd) : fd(fd) {
+    setg(in_buf.data(), in_buf.data(), in_buf.data());
+    setp(out_buf.data(), out_buf.data() + out_buf.size());
+  }
+  fd_streambuf(fd_streambuf const &) = delete;
+  fd_streambuf &operator=(fd_streambuf const &) = delete;
+  ~fd_streambuf() override { sync(); }
+
+protected:
+  int_type underflow() override {
+    ssize_t n;
+    do
+      n = ::read(fd, in_buf.data(), in_buf.size());
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+      return traits_type::eof();
+    setg(in_buf.data(), in_buf.data(), in_buf.data() + n);
+    return traits_type::to_int_type(in_buf[0]);
+  }
+
+  int_type overflow(int_type c) override {
+    if (sync() != 0)
+      return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+      sputc(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override {
+    for (char *p = pbase(); p < pptr();) {
+      ssize_t n = ::send(fd, p, pptr() - p, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      p += n;
+    }
+    setp(out_buf.data(), out_buf.data() + out_buf.size());
+    return 0;
+  }
+};
+#endif
+
+// Accepts connections on a Unix socket at path, serving each one in a
+// thread of its own. All of them share opts.pool, opts.sessions and the
+// JIT cache. Only returns on error.
+int serve_socket(char const *path, stream_options const &opts) {
+#if defined(__unix__)
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof addr.sun_path) {
+    std::cerr << "sdiffe: socket path too long: " << path << '\n';
+    return 1;
+  }
+  std::strcpy(addr.sun_path, path);
+  int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  ::unlink(path);
+  if (listener < 0 ||
+      ::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0 ||
+      ::listen(listener, 64) != 0) {
+    std::cerr << "sdiffe: cannot listen on " << path << ": "
+              << std::strerror(errno) << '\n';
+    return 1;
+  }
+  for (;;) {
+    int fd = ::accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      std::cerr << "sdiffe: accept: " << std::strerror(errno) << '\n';
+      return 1;
+    }
+    std::thread([fd, &opts] {
+      {
+        fd_streambuf buf(fd);
+        std::istream in(&buf);
+        std::ostream out(&buf);
+        serve_stream(in, out, opts);
+      }
+      ::close(fd);
+    }).detach();
+  }
+#else
+  std::cerr << "sdiffe: --listen needs Unix domain sockets\n";
+  return 1;
+#endif
+}
+
+// Synthetic workloads for --bench. Each builds its expression in the
+// current session and names the variables to differentiate it by.
+struct bench_workload {
+  char const *name;
+  base_expr_s (*build)(std::vector<base_expr_s> &vars);
+};
+
+// sum of k x^k up to degree 2000, the shape of the demo's polynomial.
+base_expr_s bench_polynomial(std::vector<base_expr_s> &vars) {
+  base_expr_s x = variable::create("x");
+  vars = {x};
+  std::vector<base_expr_s> terms;
+  for (int k = 1; k <= 2000; ++k)
+    terms.push_back(mul::create(constant::create(k),
+                                pow::create(x, constant::create(k))));
+  return add::create(terms);
+}
+
+// ln((... ln((x + x)^2 + x) ...)^2 + x), 1000 levels deep.
+base_expr_s bench_composition(std::vector<base_expr_s> &vars) {
+  base_expr_s x = variable::create("x");
+  vars = {x};
+  base_expr_s e = x;
+  for (int i = 0; i < 1000; ++i)
+    e = i % 2 ? ln::create(add::create(e, x))
+              : pow::create(add::create(e, x), constant::create(2));
+  return e;
+}
+
+// (x + 1)(x + 2)...(x + 300) with ln factors mixed in, so it stays off the
+// polynomial path.
+base_expr_s bench_product(std::vector<base_expr_s> &vars) {
+  base_expr_s x = variable::create("x");
+  vars = {x};
+  std::vector<base_expr_s> factors;
+  for (int i = 1; i <= 300; ++i) {
+    base_expr_s f = add::create(x, constant::create(i));
+    factors.push_back(i % 3 ? f : ln::create(f));
+  }
+  return mul::create(factors);
+}
+
+// sum of i x_i ln(x_{i+1}) over 500 variables.
+base_expr_s bench_wide_sum(std::vector<base_expr_s> &vars) {
+  vars.clear();
+  for (int i = 0; i <= 500; ++i)
+    vars.push_back(variable::create("x" + std::to_string(i)));
+  std::vector<base_expr_s> terms;
+  for (int i = 0; i < 500; ++i)
+    terms.push_back(mul::create(
+        {constant::create(i + 1), vars[i], ln::create(vars[i + 1])}));
+  return add::create(terms);
+}
+
+// x_{i-1} x_i + ln(x_{i+1}) - 2 x_i for i = 1..500, a system whose
+// Jacobian has three entries a row.
+std::vector<base_expr_s> bench_system(std::vector<base_expr_s> &vars) {
+  vars.clear();
+  for (int i = 0; i < 502; ++i)
+    vars.push_back(variable::create("x" + std::to_string(i)));
+  std::vector<base_expr_s> rows;
+  for (int i = 1; i <= 500; ++i)
+    rows.push_back(add::create(
+        {mul::create(vars[i - 1], vars[i]), ln::create(vars[i + 1]),
+         mul::create(constant::create(-2), vars[i])}));
+  return rows;
+}
+
+// Doubles the first 200 terms of the wide sum one at a time and after each
+// edit evaluates the sum and its derivative by x250, appending both to
+// values. Incrementally, an expr_editor rebuilds only the edited term and
+// the sum, and tape::update() lowers only what is new; otherwise the sum
+// and its tape are built again each time.
+void bench_edits(bool incremental, std::vector<std::double_t> &values) {
+  std::vector<base_expr_s> vars;
+  base_expr_s e = bench_wide_sum(vars);
+  base_expr_s v = vars[250];
+  std::vector<base_expr_s> terms;
+  for (std::size_t i = 0; i < e->arity(); ++i)
+    terms.push_back(e->operand(i));
+  std::vector<std::double_t> at;
+  for (std::size_t i = 0; i < vars.size(); ++i)
+    at.push_back(1 + i / 500.0);
+
+  std::optional<expr_editor> editor;
+  std::optional<tape> t;
+  if (incremental) {
+    editor.emplace(e);
+    t.emplace(std::vector<base_expr_s>{e, e->diff(v)}, vars);
+  }
+  for (std::size_t k = 0; k < 200; ++k) {
+    base_expr_s old = terms[k];
+    terms[k] = mul::create(constant::create(2), old);
+    std::vector<base_expr_s> roots;
+    if (incremental) {
+      e = editor->replace(old, terms[k]);
+      roots = {e, e->diff(v)};
+      t->update(roots);
+    } else {
+      e = add::create(terms);
+      roots = {e, e->diff(v)};
+      t.emplace(roots, vars);
+    }
+    for (std::double_t r : t->eval_all(at))
+      values.push_back(r);
+  }
+}
+
+// The first or second derivative of the polynomial workload at 200 points
+// in [0, 0.9), in values. "diff" and "diff2" build the derivative
+// and evaluate its tape in batch; "dual" and "hyper-dual" evaluate the
+// polynomial's own tape in dual or hyper-dual numbers and build nothing.
+void bench_points(std::string_view mode, std::vector<std::double_t> &values) {
+  std::vector<base_expr_s> vars;
+  base_expr_s e = bench_polynomial(vars);
+  constexpr std::size_t n = 200;
+  std::vector<std::double_t> xs;
+  for (std::size_t p = 0; p < n; ++p)
+    xs.push_back(0.9 * p / n);
+  std::double_t const *in[] = {xs.data()};
+  values.resize(n);
+  std::double_t *out[] = {values.data()};
+  if (mode == "diff") {
+    tape(e->diff(vars[0]), vars).eval_batch(in, n, out);
+  } else if (mode == "diff2") {
+    tape(e->diff(vars[0])->diff(vars[0]), vars).eval_batch(in, n, out);
+  } else if (mode == "dual") {
+    std::vector<std::double_t> f(n);
+    tape(e, vars).eval_dual_batch(in, n, 0, f.data(), values.data());
+  } else {
+    tape t(e, vars);
+    for (std::size_t p = 0; p < n; ++p)
+      values[p] = t.eval_hyper_dual({xs[p]}, 0, 0).d12;
+  }
+}
+
+// Peak resident set of the process so far, in KiB.
+long peak_rss_kib() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Runs every workload in a fresh session and reports, per engine mode,
+// the time to differentiate, the time to print the result, the nodes
+// allocated and the process's peak RSS. Multivariate workloads run both
+// diff() once per variable and a single gradient(); lazy_diff() runs like
+// diff(), and its results are settled as they are printed. The system
+// runs jacobian(), which differentiates every row by every variable, and
+// sparse_jacobian(); only nonzero entries are printed. The edit and points
+// rows print the values bench_edits() and bench_points() compute.
+int bench(std::ostream &os) {
+  using clock = std::chrono::steady_clock;
+  auto ms = [](clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+  bench_workload const workloads[] = {
+      {"polynomial", bench_polynomial},
+      {"composition", bench_composition},
+      {"product", bench_product},
+      {"wide-sum", bench_wide_sum},
+  };
+
+  os << "workload\tmode\tdiff_ms\tprint_ms\tout_bytes\tnodes\tpeak_rss_kib\n";
+  std::string out;
+  auto report = [&](char const *name, char const *mode, clock::time_point t0,
+                    clock::time_point t1, clock::time_point t2,
+                    std::size_t nodes) {
+    os << name << '\t' << mode << '\t' << ms(t1 - t0) << '\t' << ms(t2 - t1)
+       << '\t' << out.size() << '\t'
+       << session::current().nodes().nodes() - nodes << '\t'
+       << peak_rss_kib() << '\n';
+  };
+  auto print_values = [&](std::vector<std::double_t> const &values) {
+    out.clear();
+    char buf[32];
+    for (std::double_t v : values) {
+      out.append(buf, std::to_chars(buf, buf + sizeof buf, v).ptr);
+      out += '\n';
+    }
+  };
+  for (bench_workload const &w : workloads) {
+    for (char const *mode : {"diff", "gradient", "lazy"}) {
+      session s;
+      session_scope scope(s);
+      std::vector<base_expr_s> vars;
+      base_expr_s e = w.build(vars);
+      bool reverse = mode[0] == 'g';
+      if (reverse && vars.size() < 2)
+        continue;
+
+      std::size_t nodes = s.nodes().nodes();
+      clock::time_point t0 = clock::now();
+      std::vector<base_expr_s> partials;
+      if (reverse) {
+        partials = gradient(e, vars);
+      } else {
+        for (base_expr_s v : vars)
+          partials.push_back(mode[0] == 'l' ? e->lazy_diff(v) : e->diff(v));
+      }
+      clock::time_point t1 = clock::now();
+      out.clear();
+      for (base_expr_s d : partials) {
+        serialize(mode[0] == 'l' ? settle(d) : d, out);
+        out += '\n';
+      }
+      report(w.name, mode, t0, t1, clock::now(), nodes);
+    }
+  }
+  for (char const *mode : {"jacobian", "sparse"}) {
+    session s;
+    session_scope scope(s);
+    std::vector<base_expr_s> vars;
+    std::vector<base_expr_s> rows = bench_system(vars);
+
+    std::size_t nodes = s.nodes().nodes();
+    clock::time_point t0 = clock::now();
+    std::vector<base_expr_s> entries;
+    if (mode[0] == 'j') {
+      for (auto const &row : jacobian(rows, vars))
+        for (base_expr_s d : row) {
+          constant *c = expr_cast<constant>(d);
+          if (!c || c->value() != 0)
+            entries.push_back(d);
+        }
+    } else {
+      entries = sparse_jacobian(rows, vars).values;
+    }
+    clock::time_point t1 = clock::now();
+    out.clear();
+    for (base_expr_s d : entries) {
+      serialize(d, out);
+      out += '\n';
+    }
+    report("system", mode, t0, t1, clock::now(), nodes);
+  }
+  for (char const *mode : {"rebuild", "incremental"}) {
+    session s;
+    session_scope scope(s);
+    std::size_t nodes = s.nodes().nodes();
+    clock::time_point t0 = clock::now();
+    std::vector<std::double_t> values;
+    bench_edits(mode[0] == 'i', values);
+    clock::time_point t1 = clock::now();
+    print_values(values);
+    report("edit", mode, t0, t1, clock::now(), nodes);
+  }
+  for (char const *mode : {"diff", "dual", "diff2", "hyper-dual"}) {
+    session s;
+    session_scope scope(s);
+    std::size_t nodes = s.nodes().nodes();
+    clock::time_point t0 = clock::now();
+    std::vector<std::double_t> values;
+    bench_points(mode, values);
+    clock::time_point t1 = clock::now();
+    print_values(values);
+    report("points", mode, t0, t1, clock::now(), nodes);
+  }
+  return 0;
+}
+
+int demo() {
+  session s;
+  session_scope scope(s);
+
+  base_expr_s x(variable::create("x"));
+  base_expr_s c1(constant::create(69));
+  base_expr_s c2(constant::create(420));
+  base_expr_s c3(constant::create(5));
+  base_expr_s c4(constant::create(constant::E));
+
+  base_expr_s pow1(add::create(mul::create(c3, pow::create(x, c1)),
+                               mul::create(c3, pow::create(x, c2))));
+  base_expr_s pow2(pow::create(c3, mul::create(c1, x)));
+  base_expr_s pow3(pow::create(c4, mul::create(c1, x)));
+
+  base_expr_s pow1d(pow1->diff(x));
+  base_expr_s pow2d(pow2->diff(x));
+  base_expr_s pow3d(pow3->diff(x));
+
+  std::cout << *pow1 << "\t:\t" << *pow1d << std::endl;
   std::cout << *pow2 << "\t:\t" << *pow2d << std::endl;
   std::cout << *pow3 << "\t:\t" << *pow3d << std::endl;
   return 0;
 }
+
+void usage(std::ostream &os) {
+  os << "usage: sdiffe [-d VAR] [-n K] [-j N] [-s | --emit c|c++] [--stats]\n"
+        "              [--cache DIR [--cache-limit MB]] [FILE]\n"
+        "       sdiffe [-j N] [-s] [--cache DIR] --serve | --listen PATH\n"
+        "       sdiffe --demo\n"
+        "       sdiffe --bench\n"
+        "\n"
+        "Differentiates one expression per line of FILE, or of standard\n"
+        "input, with respect to VAR (default x); -n prints the K-th\n"
+        "derivative instead of the first. With -j, N worker threads\n"
+        "share the work, 0 meaning one per core; output order is kept.\n"
+        "-s prints S-expressions instead of infix. --emit writes a C or C++\n"
+        "function per line, named f<line>, computing the expression and its\n"
+        "derivative. --stats reports node, rewrite and cache counters and\n"
+        "phase times on standard error. --cache keeps derivatives that were\n"
+        "slow to compute in DIR, up to MB megabytes (default 1024), and\n"
+        "reuses them in later runs. --serve answers requests, one per line,\n"
+        "on standard input and output until input ends, and --listen on a\n"
+        "Unix socket at PATH:\n"
+        "  ID diff VAR EXPR          ID ok EXPR : DERIVATIVE\n"
+        "  ID eval VAR=NUM,... EXPR  ID ok VALUE\n"
+        "or ID error MESSAGE.\n";
+}
+
+int main(int argc, char *argv[]) {
+  std::ios::sync_with_stdio(false);
+  stream_options opts;
+  char const *path = nullptr;
+  long jobs = 1;
+  char const *cache_dir = nullptr;
+  std::uint64_t cache_mb = 1024;
+  bool serve = false;
+  char const *listen_path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--demo") {
+      return demo();
+    } else if (arg == "--bench") {
+      return bench(std::cout);
+    } else if ((arg == "-d" || arg == "--var") && i + 1 < argc) {
+      opts.var = argv[++i];
+    } else if ((arg == "-n" || arg == "--order") && i + 1 < argc) {
+      long order = std::strtol(argv[++i], nullptr, 10);
+      if (order <= 0) {
+        usage(std::cerr);
+        return 2;
+      }
+      opts.order = static_cast<std::size_t>(order);
+    } else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+      jobs = std::strtol(argv[++i], nullptr, 10);
+      if (jobs <= 0)
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    } else if (arg == "-s" || arg == "--sexpr") {
+      opts.format = print_format::sexpr;
+    } else if (arg == "--emit" && i + 1 < argc) {
+      std::string_view lang = argv[++i];
+      if (lang != "c" && lang != "c++") {
+        usage(std::cerr);
+        return 2;
+      }
+      opts.emit.emplace();
+      opts.emit->cpp = lang == "c++";
+      opts.emit->batch = true;
+    } else if (arg == "--cache" && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (arg == "--cache-limit" && i + 1 < argc) {
+      cache_mb = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--stats") {
+      opts.stats = true;
+    } else if (arg == "--serve") {
+      serve = true;
+    } else if (arg == "--listen" && i + 1 < argc) {
+      listen_path = argv[++i];
+    } else if (arg == "-h" || arg == "--help") {
+      usage(std::cout);
+      return 0;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      usage(std::cerr);
+      return 2;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  std::ifstream file;
+  if (path) {
+    file.open(path);
+    if (!file) {
+      std::cerr << "sdiffe: cannot open " << path << '\n';
+      return 1;
+    }
+  }
+  std::unique_ptr<thread_pool> pool;
+  if (jobs > 1)
+    pool.reset(new thread_pool(jobs));
+  opts.pool = pool.get();
+  std::unique_ptr<disk_cache> cache;
+  if (cache_dir) {
+    try {
+      cache.reset(new disk_cache(cache_dir, cache_mb << 20));
+    } catch (std::exception const &ex) {
+      std::cerr << "sdiffe: " << ex.what() << '\n';
+      return 1;
+    }
+    opts.cache = cache.get();
+  }
+  serve_sessions sessions;
+  opts.sessions = &sessions;
+  if (listen_path)
+    return serve_socket(listen_path, opts);
+  if (serve) {
+    serve_stream(std::cin, std::cout, opts);
+    if (opts.stats)
+      engine_stats::total().report(std::cerr);
+    return 0;
+  }
+  if (opts.emit)
+    std::cout << (opts.emit->cpp ? "#include <cmath>\n#include <cstddef>\n"
+                                 : "#include <math.h>\n#include <stddef.h>\n");
+  std::size_t failed =
+      differentiate_stream(path ? file : std::cin, std::cout, opts);
+  if (opts.stats)
+    engine_stats::total().report(std::cerr);
+  return failed ? 1 : 0;
+}
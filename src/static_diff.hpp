@@ -0,0 +1,448 @@
+// Compile-time counterpart of the runtime expression nodes. An expression
+// is a type built from num, lit, euler, var and the node templates below;
+// diff<I>(e) returns its derivative by var<I> as another type, simplified
+// while it is built by the same rules as the runtime create() factories:
+//
+//   c op c folds   x - 0 -> x      x - x -> 0    x / 1 -> x    0 / x -> 0
+//   x ^ 0 -> 1     x ^ 1 -> x      0 * x -> 0    1 * x -> x    ln(e) -> 1
+//
+// so zero terms vanish from the derivative's type altogether. Integer
+// constants fold exactly, and a result that would overflow 64 bits stays
+// an unfolded node evaluated in double. Evaluation is constexpr where the
+// math is (ln and non-integer powers call into <cmath>), allocates nothing
+// and inlines completely. Unlike the runtime engine, sums and products are
+// not flattened or reordered, so like terms that are not adjacent are not
+// collected; values agree either way.
+//
+//   using namespace static_diff;
+//   constexpr var<0> x;
+//   constexpr auto f = num<5>() * pow(x, num<69>()) + ln(x * x);
+//   constexpr auto df = diff<0>(f);
+//   double vars[] = {1.5};
+//   double value = df(vars);
+#ifndef SDIFFE_STATIC_DIFF_HPP
+#define SDIFFE_STATIC_DIFF_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace static_diff {
+
+struct expr_tag {};
+
+template <typename T>
+constexpr bool is_expr = std::is_base_of<expr_tag, T>::value;
+
+// Integer constant, exact at compile time.
+template <std::int64_t N> struct num : expr_tag {
+  static constexpr std::int64_t value = N;
+  constexpr double operator()(double const *) const { return N; }
+};
+
+// Constant known only by value, as with 2.5 * x.
+struct lit : expr_tag {
+  double value;
+  constexpr explicit lit(double value) : value(value) {}
+  constexpr double operator()(double const *) const { return value; }
+};
+
+// The base of the natural logarithm, so that ln(e) and e ^ u simplify.
+struct euler : expr_tag {
+  static constexpr double value = 2.718281828459045;
+  constexpr double operator()(double const *) const { return value; }
+};
+
+// The I-th entry of the values an expression is evaluated at.
+template <std::size_t I> struct var : expr_tag {
+  constexpr double operator()(double const *x) const { return x[I]; }
+};
+
+template <typename T> struct is_num : std::false_type {};
+template <std::int64_t N> struct is_num<num<N>> : std::true_type {};
+
+template <typename T>
+constexpr bool is_constant =
+    is_num<T>::value || std::is_same<T, lit>::value ||
+    std::is_same<T, euler>::value;
+
+template <typename T, std::int64_t N> constexpr bool is_value() {
+  if constexpr (is_num<T>::value)
+    return T::value == N;
+  else
+    return false;
+}
+
+// Checked int64 arithmetic for folding num constants.
+
+constexpr bool add_fits(std::int64_t a, std::int64_t b) {
+  return b > 0 ? a <= INT64_MAX - b : a >= INT64_MIN - b;
+}
+
+constexpr bool sub_fits(std::int64_t a, std::int64_t b) {
+  return b < 0 ? a <= INT64_MAX + b : a >= INT64_MIN + b;
+}
+
+constexpr bool mul_fits(std::int64_t a, std::int64_t b) {
+  if (a == 0 || b == 0)
+    return true;
+  if (a > 0)
+    return b > 0 ? a <= INT64_MAX / b : b >= INT64_MIN / a;
+  if (b > 0)
+    return a >= INT64_MIN / b;
+  return a != INT64_MIN && b != INT64_MIN && -a <= INT64_MAX / -b;
+}
+
+// Whether a / b is exact; INT64_MIN / -1 is the one quotient that
+// overflows.
+constexpr bool divides(std::int64_t a, std::int64_t b) {
+  if (a == INT64_MIN && b == -1)
+    return false;
+  return a % b == 0;
+}
+
+// base^exp for exp >= 0, exact, or fits == false when it overflows.
+struct exact_power {
+  bool fits;
+  std::int64_t value;
+};
+
+constexpr exact_power exact_pow(std::int64_t base, std::int64_t exp) {
+  if (base == 0 || base == 1)
+    return {true, exp == 0 ? 1 : base};
+  if (base == -1)
+    return {true, exp % 2 ? -1 : 1};
+  // |base| >= 2 overflows within 63 steps.
+  std::int64_t r = 1;
+  for (; exp > 0; --exp) {
+    if (!mul_fits(r, base))
+      return {false, 0};
+    r *= base;
+  }
+  return {true, r};
+}
+
+template <typename L, typename R> constexpr bool folds_add() {
+  if constexpr (is_num<L>::value && is_num<R>::value)
+    return add_fits(L::value, R::value);
+  else
+    return false;
+}
+
+template <typename L, typename R> constexpr bool folds_sub() {
+  if constexpr (is_num<L>::value && is_num<R>::value)
+    return sub_fits(L::value, R::value);
+  else
+    return false;
+}
+
+template <typename L, typename R> constexpr bool folds_mul() {
+  if constexpr (is_num<L>::value && is_num<R>::value)
+    return mul_fits(L::value, R::value);
+  else
+    return false;
+}
+
+template <typename L, typename R> struct add_ : expr_tag {
+  L lhs;
+  R rhs;
+  constexpr add_(L lhs, R rhs) : lhs(lhs), rhs(rhs) {}
+  constexpr double operator()(double const *x) const {
+    return lhs(x) + rhs(x);
+  }
+};
+
+template <typename L, typename R> struct sub_ : expr_tag {
+  L lhs;
+  R rhs;
+  constexpr sub_(L lhs, R rhs) : lhs(lhs), rhs(rhs) {}
+  constexpr double operator()(double const *x) const {
+    return lhs(x) - rhs(x);
+  }
+};
+
+template <typename L, typename R> struct mul_ : expr_tag {
+  L lhs;
+  R rhs;
+  constexpr mul_(L lhs, R rhs) : lhs(lhs), rhs(rhs) {}
+  constexpr double operator()(double const *x) const {
+    return lhs(x) * rhs(x);
+  }
+};
+
+template <typename L, typename R> struct div_ : expr_tag {
+  L lhs;
+  R rhs;
+  constexpr div_(L lhs, R rhs) : lhs(lhs), rhs(rhs) {}
+  constexpr double operator()(double const *x) const {
+    return lhs(x) / rhs(x);
+  }
+};
+
+// x^n by squaring, for exponents known at compile time.
+constexpr double ipow(double x, std::int64_t n) {
+  if (n < 0)
+    return 1 / ipow(x, -n);
+  double r = 1;
+  for (; n > 0; n >>= 1, x *= x)
+    if (n & 1)
+      r *= x;
+  return r;
+}
+
+template <typename L, typename R> struct pow_ : expr_tag {
+  L lhs;
+  R rhs;
+  constexpr pow_(L lhs, R rhs) : lhs(lhs), rhs(rhs) {}
+  constexpr double operator()(double const *x) const {
+    if constexpr (is_num<R>::value)
+      return ipow(lhs(x), R::value);
+    else
+      return std::pow(lhs(x), rhs(x));
+  }
+};
+
+template <typename E> struct ln_ : expr_tag {
+  E value;
+  constexpr explicit ln_(E value) : value(value) {}
+  constexpr double operator()(double const *x) const {
+    return std::log(value(x));
+  }
+};
+
+// Whether a lit appears in T. Two expressions of the same type are equal
+// unless they hold lit values, which the type does not capture.
+template <typename T> struct has_lit : std::false_type {};
+template <> struct has_lit<lit> : std::true_type {};
+template <template <typename, typename> class Node, typename L, typename R>
+struct has_lit<Node<L, R>>
+    : std::integral_constant<bool, has_lit<L>::value || has_lit<R>::value> {};
+template <typename E> struct has_lit<ln_<E>> : has_lit<E> {};
+
+// num<N> * X, whose constant folds into another num factor.
+template <typename T> struct is_scaled : std::false_type {};
+template <std::int64_t N, typename X>
+struct is_scaled<mul_<num<N>, X>> : std::true_type {};
+
+template <typename L, typename R> constexpr bool folds_scaled() {
+  if constexpr (is_scaled<R>::value)
+    return folds_mul<L, decltype(R::lhs)>();
+  else
+    return false;
+}
+
+// Factories, applying the simplifications in the order create() does.
+
+template <typename L, typename R> constexpr auto make_add(L lhs, R rhs) {
+  if constexpr (folds_add<L, R>())
+    return num<L::value + R::value>();
+  else if constexpr (is_value<L, 0>())
+    return rhs;
+  else if constexpr (is_value<R, 0>())
+    return lhs;
+  else
+    return add_<L, R>(lhs, rhs);
+}
+
+template <typename L, typename R> constexpr auto make_sub(L lhs, R rhs) {
+  if constexpr (folds_sub<L, R>())
+    return num<L::value - R::value>();
+  else if constexpr (is_value<R, 0>())
+    return lhs;
+  else if constexpr (std::is_same<L, R>::value && !has_lit<L>::value)
+    return num<0>();
+  else
+    return sub_<L, R>(lhs, rhs);
+}
+
+template <typename L, typename R> constexpr auto make_mul(L lhs, R rhs) {
+  if constexpr (folds_mul<L, R>())
+    return num<L::value * R::value>();
+  else if constexpr (is_value<L, 0>() || is_value<R, 0>())
+    return num<0>();
+  else if constexpr (is_value<L, 1>())
+    return rhs;
+  else if constexpr (is_value<R, 1>())
+    return lhs;
+  else if constexpr (folds_scaled<L, R>())
+    return make_mul(num<L::value * decltype(rhs.lhs)::value>(), rhs.rhs);
+  else if constexpr (is_num<R>::value && !is_num<L>::value)
+    return make_mul(rhs, lhs); // constants first, as canonical order has it
+  else
+    return mul_<L, R>(lhs, rhs);
+}
+
+// Constant quotients fold when exact, and constant powers when they fit.
+template <typename L, typename R> constexpr auto fold_div(L lhs, R rhs) {
+  if constexpr (is_num<L>::value && is_num<R>::value) {
+    if constexpr (divides(L::value, R::value))
+      return num<L::value / R::value>();
+    else
+      return div_<L, R>(lhs, rhs);
+  } else {
+    return div_<L, R>(lhs, rhs);
+  }
+}
+
+template <typename L, typename R> constexpr auto fold_pow(L lhs, R rhs) {
+  if constexpr (is_num<L>::value && is_num<R>::value) {
+    if constexpr (R::value >= 0 && exact_pow(L::value, R::value).fits)
+      return num<exact_pow(L::value, R::value).value>();
+    else
+      return pow_<L, R>(lhs, rhs);
+  } else {
+    return pow_<L, R>(lhs, rhs);
+  }
+}
+
+template <typename L, typename R> constexpr auto make_div(L lhs, R rhs) {
+  static_assert(!is_value<R, 0>(), "math error: attempted to divide by zero");
+  if constexpr (is_value<R, 1>())
+    return lhs;
+  else if constexpr (is_value<L, 0>())
+    return num<0>();
+  else
+    return fold_div(lhs, rhs);
+}
+
+template <typename L, typename R> constexpr auto make_pow(L lhs, R rhs) {
+  if constexpr (is_value<R, 0>())
+    return num<1>();
+  else if constexpr (is_value<R, 1>())
+    return lhs;
+  else
+    return fold_pow(lhs, rhs);
+}
+
+template <typename E> constexpr auto make_ln(E value) {
+  static_assert(!is_value<E, 0>(), "math error: argument of ln is zero");
+  if constexpr (std::is_same<E, euler>::value)
+    return num<1>();
+  else
+    return ln_<E>(value);
+}
+
+// Derivatives, by the rules of the runtime derive() methods.
+
+template <std::size_t I, std::int64_t N> constexpr auto diff(num<N>) {
+  return num<0>();
+}
+template <std::size_t I> constexpr auto diff(lit) { return num<0>(); }
+template <std::size_t I> constexpr auto diff(euler) { return num<0>(); }
+
+template <std::size_t I, std::size_t J> constexpr auto diff(var<J>) {
+  return num<I == J ? 1 : 0>();
+}
+
+template <std::size_t I, typename L, typename R>
+constexpr auto diff(add_<L, R> e) {
+  return make_add(diff<I>(e.lhs), diff<I>(e.rhs));
+}
+
+template <std::size_t I, typename L, typename R>
+constexpr auto diff(sub_<L, R> e) {
+  return make_sub(diff<I>(e.lhs), diff<I>(e.rhs));
+}
+
+template <std::size_t I, typename L, typename R>
+constexpr auto diff(mul_<L, R> e) {
+  return make_add(make_mul(diff<I>(e.lhs), e.rhs),
+                  make_mul(e.lhs, diff<I>(e.rhs)));
+}
+
+template <std::size_t I, typename L, typename R>
+constexpr auto diff(div_<L, R> e) {
+  return make_div(make_sub(make_mul(diff<I>(e.lhs), e.rhs),
+                           make_mul(e.lhs, diff<I>(e.rhs))),
+                  make_pow(e.rhs, num<2>()));
+}
+
+template <typename R> constexpr auto minus_one(R r) {
+  if constexpr (is_num<R>::value && R::value != INT64_MIN)
+    return num<R::value - 1>();
+  else if constexpr (is_num<R>::value)
+    return lit(static_cast<double>(R::value) - 1);
+  else if constexpr (std::is_same<R, lit>::value)
+    return lit(r.value - 1);
+  else
+    return lit(R::value - 1);
+}
+
+template <std::size_t I, typename L, typename R>
+constexpr auto diff(pow_<L, R> e) {
+  if constexpr (!is_constant<L> && is_constant<R>) {
+    return make_mul(make_mul(e.rhs, make_pow(e.lhs, minus_one(e.rhs))),
+                    diff<I>(e.lhs));
+  } else if constexpr (is_constant<L> && !is_constant<R>) {
+    return make_mul(make_mul(e, make_ln(e.lhs)), diff<I>(e.rhs));
+  } else if constexpr (is_constant<L> && is_constant<R>) {
+    return num<0>();
+  } else {
+    // d(u^v) = u^v * (v' ln(u) + v u' / u)
+    return make_mul(e, make_add(make_mul(diff<I>(e.rhs), make_ln(e.lhs)),
+                                make_div(make_mul(e.rhs, diff<I>(e.lhs)),
+                                         e.lhs)));
+  }
+}
+
+template <std::size_t I, typename E> constexpr auto diff(ln_<E> e) {
+  return make_mul(make_div(num<1>(), e.value), diff<I>(e.value));
+}
+
+// The type of the derivative of E by var<I>.
+template <std::size_t I, typename E>
+using derivative_t = decltype(diff<I>(std::declval<E>()));
+
+// Operators. Plain doubles mixed into an expression become lit.
+
+template <typename T> constexpr auto as_expr(T v) {
+  if constexpr (is_expr<T>)
+    return v;
+  else
+    return lit(static_cast<double>(v));
+}
+
+template <typename L, typename R>
+constexpr bool operands = (is_expr<L> || is_expr<R>) &&
+                          (is_expr<L> || std::is_arithmetic<L>::value) &&
+                          (is_expr<R> || std::is_arithmetic<R>::value);
+
+template <typename L, typename R,
+          typename = std::enable_if_t<operands<L, R>>>
+constexpr auto operator+(L lhs, R rhs) {
+  return make_add(as_expr(lhs), as_expr(rhs));
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<operands<L, R>>>
+constexpr auto operator-(L lhs, R rhs) {
+  return make_sub(as_expr(lhs), as_expr(rhs));
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<operands<L, R>>>
+constexpr auto operator*(L lhs, R rhs) {
+  return make_mul(as_expr(lhs), as_expr(rhs));
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<operands<L, R>>>
+constexpr auto operator/(L lhs, R rhs) {
+  return make_div(as_expr(lhs), as_expr(rhs));
+}
+
+template <typename L, typename R,
+          typename = std::enable_if_t<operands<L, R>>>
+constexpr auto pow(L lhs, R rhs) {
+  return make_pow(as_expr(lhs), as_expr(rhs));
+}
+
+template <typename E, typename = std::enable_if_t<is_expr<E>>>
+constexpr auto ln(E value) {
+  return make_ln(value);
+}
+
+} // namespace static_diff
+
+#endif